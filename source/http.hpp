@@ -11,6 +11,7 @@
 
 #define DEFALT_TIMEOUT 10
 #define MAX_LINE 8192
+#define MERGE_BODY_MAX (64 * 1024) // 不超过这个大小的正文与头部拼接成一次发送，更大的正文直接移交给连接，避免拷贝
 
 typedef enum
 {
@@ -805,9 +806,16 @@ private:
             rsp_str << head.first << ": " << head.second << "\r\n";
         }
         rsp_str << "\r\n";
-        rsp_str << rsp._body;
-        // 3. 发送数据
-        conn->Send(rsp_str.str().c_str(), rsp_str.str().size());
+        // 3. 发送数据：小的正文与头部拼接，整个响应一次发送；大的正文直接移交给连接的发送缓冲区，不再拼接拷贝
+        std::string head = rsp_str.str();
+        if (rsp._body.size() <= MERGE_BODY_MAX)
+        {
+            head += rsp._body;
+            conn->Send(std::move(head));
+            return;
+        }
+        conn->Send(std::move(head));
+        conn->Send(std::move(rsp._body));
     }
     bool IsFileHandler(const HttpRequest &req)
     {
@@ -956,7 +964,7 @@ private:
     }
 
 public:
-    HttpServer(int port, int timeout = DEFALT_TIMEOUT) : _server(port)
+    HttpServer(int port, int timeout = DEFALT_TIMEOUT, LoopBackend backend = BACKEND_EPOLL) : _server(port, backend)
     {
         _server.EnableInactiveRelease(timeout);
         _server.SetConnectedCallback(std::bind(&HttpServer::OnConnected, this, std::placeholders::_1));
@@ -988,6 +996,16 @@ public:
     {
         _server.SetThreadCount(count);
     }
+    //合并同一轮循环中流水线请求的多个响应，一次发送
+    void EnableAutoCork()
+    {
+        _server.EnableAutoCork();
+    }
+    //新连接分配到从属线程的策略，长连接较多时可以按照负载分配
+    void SetLoopStrategy(LoopStrategy strategy)
+    {
+        _server.SetLoopStrategy(strategy);
+    }
     void Listen()
     {
         _server.Start();
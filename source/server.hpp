@@ -2,9 +2,13 @@
 #define __M_SERVER_H__
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <deque>
 #include <string>
 #include <cassert>
 #include <cstring>
+#include <cstddef>
+#include <climits>
 #include <ctime>
 #include <functional>
 #include <unordered_map>
@@ -12,16 +16,32 @@
 #include <mutex>
 #include <condition_variable>
 #include <memory>
+#include <atomic>
 #include <typeinfo>
+#include <type_traits>
+#include <new>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <random>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#include <optional>
+#endif
 
 #define INF 0
 #define DBG 1
@@ -41,21 +61,193 @@
 #define DBG_LOG(format, ...) LOG(DBG, format, ##__VA_ARGS__)
 #define ERR_LOG(format, ...) LOG(ERR, format, ##__VA_ARGS__)
 
+#define BLOCK_POOL_CLASSES 3
+#define BLOCK_POOL_MAX_BYTES (4 * 1024 * 1024)
+//内存块池：每个EventLoop一个，缓存4K/16K/64K三种规格的内存块，连接释放的内存块留给后续连接复用
+//只在所属的EventLoop线程中使用，因此不需要加锁
+class BlockPool {
+    private:
+        std::vector<char*> _free[BLOCK_POOL_CLASSES]; //每种规格的空闲块
+        uint64_t _hits;     //直接从池中取到内存块的次数
+        uint64_t _misses;   //池中没有空闲块，需要向系统申请的次数
+    public:
+        BlockPool():_hits(0), _misses(0) {}
+        BlockPool(const BlockPool&) = delete;
+        BlockPool &operator=(const BlockPool&) = delete;
+        ~BlockPool() {
+            for (int i = 0; i < BLOCK_POOL_CLASSES; i++) {
+                for (auto block : _free[i]) delete[] block;
+            }
+        }
+        //规格大小：4K, 16K, 64K
+        static uint64_t ClassSize(int idx) { return (uint64_t)4096 << (2 * idx); }
+        //获取能够容纳size的最小规格，超过最大规格返回-1
+        static int SizeClass(uint64_t size) {
+            for (int i = 0; i < BLOCK_POOL_CLASSES; i++) {
+                if (size <= ClassSize(i)) return i;
+            }
+            return -1;
+        }
+        //申请一块至少size大小的内存，实际大小通过real_size返回
+        char *Alloc(uint64_t size, uint64_t *real_size) {
+            int idx = SizeClass(size);
+            if (idx < 0) {
+                //超过最大规格的大块内存不做缓存
+                _misses++;
+                *real_size = size;
+                return new char[size];
+            }
+            *real_size = ClassSize(idx);
+            if (_free[idx].empty()) {
+                _misses++;
+                return new char[*real_size];
+            }
+            _hits++;
+            char *block = _free[idx].back();
+            _free[idx].pop_back();
+            return block;
+        }
+        //归还内存块，size必须是Alloc返回的实际大小
+        void Free(char *block, uint64_t size) {
+            int idx = SizeClass(size);
+            if (idx < 0 || ClassSize(idx) != size || (_free[idx].size() + 1) * size > BLOCK_POOL_MAX_BYTES) {
+                delete[] block;
+                return;
+            }
+            _free[idx].push_back(block);
+        }
+        uint64_t Hits() { return _hits; }
+        uint64_t Misses() { return _misses; }
+        //命中率
+        double HitRate() {
+            uint64_t total = _hits + _misses;
+            return total == 0 ? 0 : (double)_hits / total;
+        }
+        //当前缓存的空闲内存总量
+        uint64_t CachedBytes() {
+            uint64_t bytes = 0;
+            for (int i = 0; i < BLOCK_POOL_CLASSES; i++) bytes += _free[i].size() * ClassSize(i);
+            return bytes;
+        }
+};
+
+#define FRAME_POOL_STEP 64         //协程帧按照64字节对齐分级
+#define FRAME_POOL_CLASSES 16      //缓存64B到1K的帧，更大的帧直接向系统申请
+#define FRAME_POOL_MAX_CACHED 256  //每种规格最多缓存的空闲帧数量
+//协程帧池：每个EventLoop一个，同一个协程函数的帧大小固定，每个连接的处理协程结束之后帧留给下一个连接复用
+//只在所属的EventLoop线程中使用，因此不需要加锁；帧都是operator new申请的，在其他线程中释放也可以直接delete
+class FramePool {
+    private:
+        std::vector<void*> _free[FRAME_POOL_CLASSES];
+        static size_t SizeClass(size_t size) { return (size + FRAME_POOL_STEP - 1) / FRAME_POOL_STEP - 1; }
+    public:
+        FramePool() {}
+        FramePool(const FramePool&) = delete;
+        FramePool &operator=(const FramePool&) = delete;
+        ~FramePool() {
+            for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+                for (auto frame : _free[i]) ::operator delete(frame);
+            }
+        }
+        //按照规格向系统申请，不在EventLoop线程中申请的帧也可能被某个帧池缓存，因此也必须使用这个接口
+        static void *RawAlloc(size_t size) {
+            size_t idx = SizeClass(size);
+            if (idx >= FRAME_POOL_CLASSES) return ::operator new(size);
+            return ::operator new((idx + 1) * FRAME_POOL_STEP);
+        }
+        void *Alloc(size_t size) {
+            size_t idx = SizeClass(size);
+            if (idx >= FRAME_POOL_CLASSES || _free[idx].empty()) return RawAlloc(size);
+            void *frame = _free[idx].back();
+            _free[idx].pop_back();
+            return frame;
+        }
+        //size必须与Alloc时相同
+        void Free(void *frame, size_t size) {
+            size_t idx = SizeClass(size);
+            if (idx >= FRAME_POOL_CLASSES || _free[idx].size() >= FRAME_POOL_MAX_CACHED) return ::operator delete(frame);
+            _free[idx].push_back(frame);
+        }
+};
+
 #define BUFFER_DEFAULT_SIZE 1024
 class Buffer {
     private:
-        std::vector<char> _buffer; //使用vector进行内存空间管理
-        uint64_t _reader_idx; //读偏移
-        uint64_t _writer_idx; //写偏移
+        char *_buffer;          //缓冲区空间，设置了内存块池的话从池中获取
+        uint64_t _capacity;     //缓冲区空间大小
+        uint64_t _reader_idx;   //读偏移
+        uint64_t _writer_idx;   //写偏移
+        BlockPool *_pool;       //所属EventLoop的内存块池，为NULL则直接向系统申请
+    private:
+        char *AllocBlock(uint64_t size, uint64_t *real_size) {
+            if (_pool) return _pool->Alloc(size, real_size);
+            *real_size = size;
+            return new char[size];
+        }
+        //释放缓冲区空间，有内存块池则归还给池
+        void FreeBlock() {
+            if (_buffer == NULL) return;
+            if (_pool) _pool->Free(_buffer, _capacity);
+            else delete[] _buffer;
+            _buffer = NULL;
+            _capacity = 0;
+        }
+        //数据已经全部读走，把内存块还给池，下次写入时再重新获取
+        void ReleaseIfDrained() {
+            if (_pool && _reader_idx == _writer_idx) {
+                FreeBlock();
+                _reader_idx = _writer_idx = 0;
+            }
+        }
     public:
-        Buffer():_reader_idx(0), _writer_idx(0), _buffer(BUFFER_DEFAULT_SIZE){}
-        char *Begin() { return &*_buffer.begin(); }
+        //使用内存块池的缓冲区在有数据写入时才获取空间，否则预先申请默认大小的空间
+        explicit Buffer(BlockPool *pool = NULL):_buffer(NULL), _capacity(0), _reader_idx(0), _writer_idx(0), _pool(pool) {
+            if (_pool == NULL) {
+                _buffer = AllocBlock(BUFFER_DEFAULT_SIZE, &_capacity);
+            }
+        }
+        //拷贝出来的缓冲区不属于任何EventLoop，因此不使用内存块池
+        Buffer(const Buffer &other):_buffer(NULL), _capacity(0), _reader_idx(0), _writer_idx(0), _pool(NULL) {
+            uint64_t len = other._writer_idx - other._reader_idx;
+            _buffer = AllocBlock(std::max(len, (uint64_t)BUFFER_DEFAULT_SIZE), &_capacity);
+            std::copy(other._buffer + other._reader_idx, other._buffer + other._writer_idx, _buffer);
+            _writer_idx = len;
+        }
+        Buffer(Buffer &&other):_buffer(other._buffer), _capacity(other._capacity), _reader_idx(other._reader_idx), 
+            _writer_idx(other._writer_idx), _pool(other._pool) {
+            other._buffer = NULL;
+            other._capacity = other._reader_idx = other._writer_idx = 0;
+        }
+        Buffer &operator=(Buffer other) {
+            std::swap(_buffer, other._buffer);
+            std::swap(_capacity, other._capacity);
+            std::swap(_reader_idx, other._reader_idx);
+            std::swap(_writer_idx, other._writer_idx);
+            std::swap(_pool, other._pool);
+            return *this;
+        }
+        //析构时可能已经不在所属的EventLoop线程中了，不能再操作内存块池，直接释放
+        //需要归还内存块的话，应当在EventLoop线程中先调用Clear
+        ~Buffer() { delete[] _buffer; }
+        //设置内存块池，只能在缓冲区还没有数据的时候设置
+        void SetPool(BlockPool *pool) {
+            assert(ReadAbleSize() == 0);
+            delete[] _buffer;
+            _buffer = NULL;
+            _capacity = _reader_idx = _writer_idx = 0;
+            _pool = pool;
+        }
+        //更换内存块池，已有的数据保留，之后归还给新的池（内存块都是new[]申请的，可以在池之间转移）
+        void ChangePool(BlockPool *pool) { _pool = pool; }
+        //当前占用的空间大小
+        uint64_t Capacity() { return _capacity; }
+        char *Begin() { return _buffer; }
         //获取当前写入起始地址, _buffer的空间起始地址，加上写偏移量
         char *WritePosition() { return Begin() + _writer_idx; }
         //获取当前读取起始地址
         char *ReadPosition() { return Begin() + _reader_idx; }
         //获取缓冲区末尾空闲空间大小--写偏移之后的空闲空间, 总体空间大小减去写偏移
-        uint64_t TailIdleSize() { return _buffer.size() - _writer_idx; }
+        uint64_t TailIdleSize() { return _capacity - _writer_idx; }
         //获取缓冲区起始空闲空间大小--读偏移之前的空闲空间
         uint64_t HeadIdleSize() { return _reader_idx; }
         //获取可读数据大小 = 写偏移 - 读偏移
@@ -66,6 +258,7 @@ class Buffer {
             //向后移动的大小，必须小于可读数据大小
             assert(len <= ReadAbleSize());
             _reader_idx += len;
+            ReleaseIfDrained();
         }
         //将写偏移向后移动 
         void MoveWriteOffset(uint64_t len) {
@@ -85,9 +278,18 @@ class Buffer {
                 _reader_idx = 0;    //将读偏移归0
                 _writer_idx = rsz;  //将写位置置为可读数据大小， 因为当前的可读数据大小就是写偏移量
             }else {
-                //总体空间不够，则需要扩容，不移动数据，直接给写偏移之后扩容足够空间即可
-                DBG_LOG("RESIZE %ld", _writer_idx + len);
-                _buffer.resize(_writer_idx + len);
+                //总体空间不够，则需要扩容，申请一块新的空间（至少翻倍，避免反复扩容），把可读数据拷贝过去
+                uint64_t rsz = ReadAbleSize();
+                uint64_t size = std::max(rsz + len, _capacity * 2);
+                DBG_LOG("RESIZE %ld", size);
+                uint64_t capacity = 0;
+                char *block = AllocBlock(size, &capacity);
+                if (rsz > 0) std::copy(ReadPosition(), ReadPosition() + rsz, block);
+                FreeBlock();
+                _buffer = block;
+                _capacity = capacity;
+                _reader_idx = 0;
+                _writer_idx = rsz;
             }
         } 
         //写入数据
@@ -141,6 +343,7 @@ class Buffer {
             return str;
         }
         char *FindCRLF() {
+            if (ReadAbleSize() == 0) return NULL;
             char *res = (char*)memchr(ReadPosition(), '\n', ReadAbleSize());
             return res;
         }
@@ -158,15 +361,180 @@ class Buffer {
             MoveReadOffset(str.size());
             return str;
         }
+        //从描述符中读取数据直接放入缓冲区，末尾空闲空间不够的部分先读到栈上的备用空间，再追加进来
+        //返回值与readv一致，出错时通过save_errno返回错误码
+        ssize_t ReadFromFd(int fd, int *save_errno) {
+            //使用内存块池时，空缓冲区先从池中取一块最小规格的空间，让数据尽量直接读进缓冲区
+            if (_pool && _buffer == NULL) EnsureWriteSpace(BlockPool::ClassSize(0));
+            char extrabuf[65536];
+            struct iovec vec[2];
+            uint64_t writable = TailIdleSize();
+            vec[0].iov_base = WritePosition();
+            vec[0].iov_len = writable;
+            vec[1].iov_base = extrabuf;
+            vec[1].iov_len = sizeof(extrabuf);
+            //使用内存块池时，限制备用空间的大小，让追加之后的总大小不超过最大规格，扩容时仍然可以从池中获取
+            uint64_t used = ReadAbleSize() + writable, max_class = BlockPool::ClassSize(BLOCK_POOL_CLASSES - 1);
+            if (_pool && used < max_class) vec[1].iov_len = std::min((uint64_t)sizeof(extrabuf), max_class - used);
+            //缓冲区空闲空间已经足够大了，就不再使用备用空间
+            int iovcnt = (writable < sizeof(extrabuf)) ? 2 : 1;
+            ssize_t ret = readv(fd, vec, iovcnt);
+            if (ret < 0) {
+                *save_errno = errno;
+            }else if ((uint64_t)ret <= writable) {
+                MoveWriteOffset(ret);
+            }else {
+                MoveWriteOffset(writable);
+                WriteAndPush(extrabuf, ret - writable);
+            }
+            return ret;
+        }
+        //收缩空间：大数据传输之后缓冲区中只剩下少量数据时，换一块刚好够用的空间，不再长期占用大块内存
+        void ShrinkToFit() {
+            uint64_t rsz = ReadAbleSize();
+            if (_buffer == NULL || _capacity <= BlockPool::ClassSize(BLOCK_POOL_CLASSES - 1)) return;
+            if (rsz > _capacity / 4) return;
+            uint64_t capacity = 0;
+            char *block = AllocBlock(std::max(rsz, (uint64_t)BUFFER_DEFAULT_SIZE), &capacity);
+            std::copy(ReadPosition(), ReadPosition() + rsz, block);
+            FreeBlock();
+            _buffer = block;
+            _capacity = capacity;
+            _reader_idx = 0;
+            _writer_idx = rsz;
+        }
         //清空缓冲区
         void Clear() {
-            //只需要将偏移量归0即可
+            //只需要将偏移量归0即可，使用内存块池的话同时把空间还给池
             _reader_idx = 0;
             _writer_idx = 0;
+            ReleaseIfDrained();
+        }
+};
+
+#define OUTPUT_BLOCK_SIZE 4096
+#define OUTPUT_SLICE_MIN 1024
+//发送队列：由固定大小的块以及调用者交出的数据片段组成的链表
+//写入时不会整体扩容和搬移数据，发送时通过writev一次性把多个分段交给内核
+class OutputQueue {
+    private:
+        struct Segment {
+            const char *_base;  //分段数据的起始地址
+            uint64_t _start;    //未发送数据的起始偏移
+            uint64_t _end;      //数据的结束偏移，对自有块来说也就是写偏移
+            char *_block;       //队列自有的固定大小块，如果是调用者交出的片段则为NULL
+            std::shared_ptr<const void> _holder; //片段数据的持有者，保证数据在发送完成之前一直有效
+        };
+        //用vector加头部下标实现队列，空队列不占用任何堆空间（std::deque构造时就会申请空间）
+        std::vector<Segment> _segments;
+        size_t _head;   //第一个未发送完的分段下标
+        uint64_t _size; //待发送数据的总大小
+        BlockPool *_pool; //所属EventLoop的内存块池，为NULL则直接向系统申请
+    private:
+        void PopFront() {
+            Segment &head = _segments[_head];
+            if (head._block != NULL) {
+                if (_pool) _pool->Free(head._block, OUTPUT_BLOCK_SIZE);
+                else delete[] head._block;
+            }
+            head._holder.reset();
+            if (++_head == _segments.size()) {
+                _segments.clear();
+                _head = 0;
+            }else if (_head * 2 >= _segments.size()) {
+                //一直没有发送完的连接不会走到上面的清空，已发送的分段超过一半时整体前移，避免无限增长
+                _segments.erase(_segments.begin(), _segments.begin() + _head);
+                _head = 0;
+            }
+        }
+        //获取末尾自有块中剩余的空闲空间，末尾不是自有块则返回0
+        uint64_t TailIdleSize() {
+            if (_segments.empty() || _segments.back()._block == NULL) return 0;
+            return OUTPUT_BLOCK_SIZE - _segments.back()._end;
+        }
+    public:
+        explicit OutputQueue(BlockPool *pool = NULL):_head(0), _size(0), _pool(pool) {}
+        OutputQueue(const OutputQueue&) = delete;
+        OutputQueue &operator=(const OutputQueue&) = delete;
+        //析构时可能已经不在所属的EventLoop线程中了，不能再操作内存块池，直接释放
+        ~OutputQueue() { _pool = NULL; Clear(); }
+        //更换内存块池，已有的分段保留，之后归还给新的池
+        void ChangePool(BlockPool *pool) { _pool = pool; }
+        //获取待发送数据大小
+        uint64_t ReadAbleSize() { return _size; }
+        //拷贝写入数据，先填满末尾块的空闲空间，不够再追加新的块
+        void Write(const void *data, uint64_t len) {
+            const char *d = (const char *)data;
+            while (len > 0) {
+                if (TailIdleSize() == 0) {
+                    Segment seg;
+                    uint64_t real_size = OUTPUT_BLOCK_SIZE;
+                    seg._block = _pool ? _pool->Alloc(OUTPUT_BLOCK_SIZE, &real_size) : new char[OUTPUT_BLOCK_SIZE];
+                    seg._base = seg._block;
+                    seg._start = seg._end = 0;
+                    _segments.push_back(seg);
+                }
+                Segment &tail = _segments.back();
+                uint64_t sz = std::min(len, TailIdleSize());
+                std::copy(d, d + sz, tail._block + tail._end);
+                tail._end += sz;
+                _size += sz;
+                d += sz;
+                len -= sz;
+            }
+        }
+        //不拷贝数据，直接把调用者的数据片段挂到队列末尾，holder负责保证数据的生命周期
+        //片段太小的话直接拷贝，避免writev时产生大量零碎的iovec
+        void WriteSlice(const char *data, uint64_t len, const std::shared_ptr<const void> &holder) {
+            if (len == 0) return;
+            if (len < OUTPUT_SLICE_MIN) return Write(data, len);
+            Segment seg;
+            seg._block = NULL;
+            seg._base = data;
+            seg._start = 0;
+            seg._end = len;
+            seg._holder = holder;
+            _segments.push_back(seg);
+            _size += len;
+        }
+        //将待发送的分段填充到iov数组中，最多max个，返回实际填充的个数
+        int PeekIov(struct iovec *iov, int max) {
+            int cnt = 0;
+            for (size_t i = _head; i < _segments.size(); i++) {
+                if (cnt >= max) break;
+                Segment &seg = _segments[i];
+                iov[cnt].iov_base = (void*)(seg._base + seg._start);
+                iov[cnt].iov_len = seg._end - seg._start;
+                cnt++;
+            }
+            return cnt;
+        }
+        //已经发送了len长度的数据，释放发送完毕的分段
+        void MoveReadOffset(uint64_t len) {
+            assert(len <= _size);
+            _size -= len;
+            while (len > 0) {
+                Segment &head = _segments[_head];
+                uint64_t sz = std::min(len, head._end - head._start);
+                head._start += sz;
+                len -= sz;
+                if (head._start == head._end) PopFront();
+            }
+        }
+        //清空队列
+        void Clear() {
+            while (!_segments.empty()) PopFront();
+            _size = 0;
+        }
+        //释放队列自身占用的空间，用于连接空闲之后
+        void ShrinkToFit() {
+            if (_segments.empty()) std::vector<Segment>().swap(_segments);
         }
 };
 
 #define MAX_LISTEN 1024
+#define READ_BUDGET_DEFAULT (1024 * 1024)
+#define ACCEPT_BUDGET_DEFAULT 256
 class Socket {
     private:
         int _sockfd;
@@ -235,6 +603,15 @@ class Socket {
             }
             return newfd;
         }
+        //非阻塞获取新连接，新描述符直接设置为非阻塞和CLOEXEC，出错返回-1并通过save_errno带出错误码
+        int NonBlockAccept(int *save_errno) {
+            int newfd = accept4(_sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (newfd < 0) {
+                *save_errno = errno;
+                return -1;
+            }
+            return newfd;
+        }
         //接收数据
         ssize_t Recv(void *buf, size_t len, int flag = 0) {
             // ssize_t recv(int sockfd, void *buf, size_t len, int flag);
@@ -270,6 +647,24 @@ class Socket {
             if (len == 0) return 0;
             return Send(buf, len, MSG_DONTWAIT); // MSG_DONTWAIT 表示当前发送为非阻塞。
         }
+        //聚集发送，一次系统调用发送多个分段的数据
+        ssize_t NonBlockSendV(const struct iovec *iov, int iovcnt) {
+            if (iovcnt == 0) return 0;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = (struct iovec*)iov;
+            msg.msg_iovlen = iovcnt;
+            // ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags);
+            ssize_t ret = sendmsg(_sockfd, &msg, MSG_DONTWAIT);
+            if (ret < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    return 0;
+                }
+                ERR_LOG("SOCKET SENDV FAILED!!");
+                return -1;
+            }
+            return ret;//实际发送的数据长度
+        }
         //关闭套接字
         void Close() {
             if (_sockfd != -1) {
@@ -279,12 +674,13 @@ class Socket {
         }
         //创建一个服务端连接
         bool CreateServer(uint16_t port, const std::string &ip = "0.0.0.0", bool block_flag = false) {
-            //1. 创建套接字，2. 绑定地址，3. 开始监听，4. 设置非阻塞， 5. 启动地址重用
+            //1. 创建套接字，2. 设置非阻塞， 3. 启动地址重用，4. 绑定地址，5. 开始监听
+            //地址重用选项必须在绑定之前设置才会生效
             if (Create() == false) return false;
             if (block_flag) NonBlock();
+            ReuseAddress();
             if (Bind(ip, port) == false) return false;
             if (Listen() == false) return false;
-            ReuseAddress();
             return true;
         }
         //创建一个客户端连接
@@ -302,6 +698,17 @@ class Socket {
             val = 1;
             setsockopt(_sockfd, SOL_SOCKET, SO_REUSEPORT, (void*)&val, sizeof(int));
         }
+        //设置套接字的忙轮询时间（微秒）：接收队列为空时，在驱动中轮询这么长时间再睡眠，超过系统设置的上限需要CAP_NET_ADMIN权限
+        void BusyPoll(int us) {
+            if (setsockopt(_sockfd, SOL_SOCKET, SO_BUSY_POLL, (void*)&us, sizeof(int)) < 0) {
+                ERR_LOG("SET SO_BUSY_POLL FAILED:%s", strerror(errno));
+            }
+        }
+        //关闭Nagle算法：数据直接发送时，同一个响应分成多次发送的小段不会等待对端的延迟确认
+        void NoDelay() {
+            int val = 1;
+            setsockopt(_sockfd, IPPROTO_TCP, TCP_NODELAY, (void*)&val, sizeof(int));
+        }
         //设置套接字阻塞属性-- 设置为非阻塞
         void NonBlock() {
             //int fcntl(int fd, int cmd, ... /* arg */ );
@@ -310,6 +717,91 @@ class Socket {
         }
 };
 
+#define FUNCTION_INLINE_SIZE 64
+#define CALLBACK_INLINE_SIZE 16 //Channel的事件回调只捕获this，用较小的内部空间，避免每个连接多占用几百字节
+template<typename Signature, size_t Size = FUNCTION_INLINE_SIZE, size_t Align = alignof(std::max_align_t)> class InlineFunction;
+//只能移动的函数对象，用于任务以及事件回调：不超过Size字节、移动不会抛异常的可调用对象直接保存在对象内部，
+//常见的std::bind(成员函数, this/shared_ptr, 几个参数)都放得下，只有更大的才申请堆空间
+template<typename R, typename... Args, size_t Size, size_t Align>
+class InlineFunction<R(Args...), Size, Align> {
+    static_assert(Size >= sizeof(void*), "inline storage must hold a pointer");
+    private:
+        struct Ops {
+            R (*_invoke)(void *storage, Args&&... args);
+            void (*_move)(void *dst, void *src);//移动到dst，并析构src中的对象
+            void (*_destroy)(void *storage);
+        };
+        template<typename F>
+        struct InlineOps {
+            static R Invoke(void *s, Args&&... args) { return (*(F*)s)(std::forward<Args>(args)...); }
+            static void Move(void *d, void *s) { new (d) F(std::move(*(F*)s)); ((F*)s)->~F(); }
+            static void Destroy(void *s) { ((F*)s)->~F(); }
+            static const Ops *Table() { static const Ops ops = { Invoke, Move, Destroy }; return &ops; }
+        };
+        template<typename F>
+        struct HeapOps {
+            static R Invoke(void *s, Args&&... args) { return (**(F**)s)(std::forward<Args>(args)...); }
+            static void Move(void *d, void *s) { *(F**)d = *(F**)s; }
+            static void Destroy(void *s) { delete *(F**)s; }
+            static const Ops *Table() { static const Ops ops = { Invoke, Move, Destroy }; return &ops; }
+        };
+        template<typename F>
+        struct FitsInline {
+            static const bool value = sizeof(F) <= Size && alignof(F) <= Align &&
+                std::is_nothrow_move_constructible<F>::value;
+        };
+        //空的std::function以及空指针构造出来的也是空对象
+        template<typename F> static bool IsNull(const F &) { return false; }
+        template<typename F> static bool IsNull(const std::function<F> &f) { return !f; }
+        template<typename F> static bool IsNull(F *f) { return f == NULL; }
+        template<typename F>
+        void Construct(F &&f, std::true_type) {
+            new (&_storage) typename std::decay<F>::type(std::forward<F>(f));
+            _ops = InlineOps<typename std::decay<F>::type>::Table();
+        }
+        template<typename F>
+        void Construct(F &&f, std::false_type) {
+            *(typename std::decay<F>::type **)&_storage = new typename std::decay<F>::type(std::forward<F>(f));
+            _ops = HeapOps<typename std::decay<F>::type>::Table();
+        }
+    private:
+        mutable typename std::aligned_storage<Size, Align>::type _storage;
+        const Ops *_ops;//为NULL表示空对象
+    public:
+        InlineFunction():_ops(NULL) {}
+        InlineFunction(std::nullptr_t):_ops(NULL) {}
+        template<typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, InlineFunction>::value>::type>
+        InlineFunction(F &&f):_ops(NULL) {
+            if (IsNull(f)) return;
+            Construct(std::forward<F>(f), std::integral_constant<bool, FitsInline<typename std::decay<F>::type>::value>());
+        }
+        InlineFunction(InlineFunction &&other):_ops(other._ops) {
+            if (_ops) _ops->_move(&_storage, &other._storage);
+            other._ops = NULL;
+        }
+        InlineFunction(const InlineFunction&) = delete;
+        InlineFunction &operator=(const InlineFunction&) = delete;
+        InlineFunction &operator=(InlineFunction &&other) {
+            if (this == &other) return *this;
+            if (_ops) _ops->_destroy(&_storage);
+            _ops = other._ops;
+            if (_ops) _ops->_move(&_storage, &other._storage);
+            other._ops = NULL;
+            return *this;
+        }
+        InlineFunction &operator=(std::nullptr_t) {
+            if (_ops) _ops->_destroy(&_storage);
+            _ops = NULL;
+            return *this;
+        }
+        ~InlineFunction() { if (_ops) _ops->_destroy(&_storage); }
+        explicit operator bool() const { return _ops != NULL; }
+        R operator()(Args... args) const { return _ops->_invoke(&_storage, std::forward<Args>(args)...); }
+};
+using TaskFunc = InlineFunction<void()>;
+using ReleaseFunc = InlineFunction<void()>;
+
 class Poller;
 class EventLoop;
 class Channel {
@@ -318,22 +810,27 @@ class Channel {
         EventLoop *_loop;
         uint32_t _events;  // 当前需要监控的事件
         uint32_t _revents; // 当前连接触发的事件
-        using EventCallback = std::function<void()>;
+        bool _dirty;       // 是否有还没有提交给epoll的监控事件修改
+        using EventCallback = InlineFunction<void(), CALLBACK_INLINE_SIZE, alignof(void*)>;
         EventCallback _read_callback;   //可读事件被触发的回调函数
         EventCallback _write_callback;  //可写事件被触发的回调函数
         EventCallback _error_callback;  //错误事件被触发的回调函数
         EventCallback _close_callback;  //连接断开事件被触发的回调函数
         EventCallback _event_callback;  //任意事件被触发的回调函数
     public:
-        Channel(EventLoop *loop, int fd):_fd(fd), _events(0), _revents(0), _loop(loop) {}
+        Channel(EventLoop *loop, int fd):_fd(fd), _loop(loop), _events(0), _revents(0), _dirty(false) {}
         int Fd() { return _fd; }
+        //更换所属的EventLoop，只能在没有添加事件监控时调用
+        void SetLoop(EventLoop *loop) { _loop = loop; }
+        bool Dirty() { return _dirty; }
+        void SetDirty(bool dirty) { _dirty = dirty; }
         uint32_t Events() { return _events; }//获取想要监控的事件
         void SetREvents(uint32_t events) { _revents = events; }//设置实际就绪的事件
-        void SetReadCallback(const EventCallback &cb) { _read_callback = cb; }
-        void SetWriteCallback(const EventCallback &cb) { _write_callback = cb; }
-        void SetErrorCallback(const EventCallback &cb) { _error_callback = cb; }
-        void SetCloseCallback(const EventCallback &cb) { _close_callback = cb; }
-        void SetEventCallback(const EventCallback &cb) { _event_callback = cb; }
+        void SetReadCallback(EventCallback cb) { _read_callback = std::move(cb); }
+        void SetWriteCallback(EventCallback cb) { _write_callback = std::move(cb); }
+        void SetErrorCallback(EventCallback cb) { _error_callback = std::move(cb); }
+        void SetCloseCallback(EventCallback cb) { _close_callback = std::move(cb); }
+        void SetEventCallback(EventCallback cb) { _event_callback = std::move(cb); }
         //当前是否监控了可读
         bool ReadAble() { return (_events & EPOLLIN); } 
         //当前是否监控了可写
@@ -342,14 +839,19 @@ class Channel {
         void EnableRead() { _events |= EPOLLIN; Update(); }
         //启动写事件监控
         void EnableWrite() { _events |= EPOLLOUT; Update(); }
+        //设置为边缘触发模式，可写事件一直保持监控，不再反复开关；需要在启动读事件监控之前设置
+        void EnableEdgeTrigger() { _events |= EPOLLET | EPOLLOUT; }
+        //当前是否是边缘触发模式
+        bool EdgeTriggered() { return (_events & EPOLLET); }
         //关闭读事件监控
         void DisableRead() { _events &= ~EPOLLIN; Update(); }
         //关闭写事件监控
         void DisableWrite() { _events &= ~EPOLLOUT; Update(); }
         //关闭所有事件监控
         void DisableAll() { _events = 0; Update(); }
-        //移除监控
+        //移除监控，立即生效
         void Remove();
+        //修改监控，并不立即调用epoll_ctl，而是由EventLoop在本轮循环结束、下一次事件监控之前统一提交
         void Update();
         //事件处理，一旦连接触发了事件，就调用这个函数，自己触发了什么事件如何处理自己决定
         void HandleEvent() {
@@ -358,7 +860,8 @@ class Channel {
                 if (_read_callback) _read_callback();
             }
             /*有可能会释放连接的操作事件，一次只处理一个*/
-            if (_revents & EPOLLOUT) {
+            /*边缘触发模式下可写事件一直在监控，出错/挂断时也会带上EPOLLOUT，因此出错/挂断优先处理*/
+            if ((_revents & EPOLLOUT) && !(_revents & (EPOLLERR | EPOLLHUP))) {
                 if (_write_callback) _write_callback();
             }else if (_revents & EPOLLERR) {
                 if (_error_callback) _error_callback();//一旦出错，就会释放连接，因此要放到前边调用任意回调
@@ -373,15 +876,22 @@ class Poller {
     private:
         int _epfd;
         struct epoll_event _evs[MAX_EPOLLEVENTS];
-        std::unordered_map<int, Channel *> _channels;
+        struct Entry {
+            Channel *_channel;  //添加了监控的Channel
+            uint32_t _events;   //已经提交给epoll的监控事件
+        };
+        std::vector<Entry> _channels; //以描述符为下标保存添加了监控的Channel，描述符是从小到大复用的，数组很紧凑
+        uint64_t _ctl_calls;    //实际调用epoll_ctl的次数
+        uint64_t _ctl_avoided;  //合并、抵消之后省掉的epoll_ctl次数
     private:
         //对epoll的直接操作
         void Update(Channel *channel, int op) {
             // int epoll_ctl(int epfd, int op,  int fd,  struct epoll_event *ev);
             int fd = channel->Fd();
             struct epoll_event ev;
-            ev.data.fd = fd;
+            ev.data.ptr = channel;//直接保存Channel指针，事件就绪后不需要再查找
             ev.events = channel->Events();
+            _ctl_calls++;
             int ret = epoll_ctl(_epfd, op, fd, &ev);
             if (ret < 0) {
                 ERR_LOG("EPOLLCTL FAILED!");
@@ -390,42 +900,56 @@ class Poller {
         }
         //判断一个Channel是否已经添加了事件监控
         bool HasChannel(Channel *channel) {
-            auto it = _channels.find(channel->Fd());
-            if (it == _channels.end()) {
-                return false;
-            }
-            return true;
+            int fd = channel->Fd();
+            return fd < (int)_channels.size() && _channels[fd]._channel == channel;
         }
     public:
-        Poller() {
+        Poller():_ctl_calls(0), _ctl_avoided(0) {
             _epfd = epoll_create(MAX_EPOLLEVENTS);
             if (_epfd < 0) {
                 ERR_LOG("EPOLL CREATE FAILED!!");
                 abort();//退出程序
             }
         }
+        ~Poller() { close(_epfd); }
         //添加或修改监控事件
         void UpdateEvent(Channel *channel) {
             bool ret = HasChannel(channel);
+            int fd = channel->Fd();
             if (ret == false) {
                 //不存在则添加
-                _channels.insert(std::make_pair(channel->Fd(), channel));
+                if (fd >= (int)_channels.size()) _channels.resize(fd + 1, Entry{NULL, 0});
+                _channels[fd]._channel = channel;
+                _channels[fd]._events = channel->Events();
                 return Update(channel, EPOLL_CTL_ADD);
             }
+            //几次修改之后和已经提交的事件一样（比如开启又关闭了写事件），就不需要再调用epoll_ctl
+            if (_channels[fd]._events == channel->Events()) {
+                _ctl_avoided++;
+                return;
+            }
+            _channels[fd]._events = channel->Events();
             return Update(channel, EPOLL_CTL_MOD);
         }
         //移除监控
         void RemoveEvent(Channel *channel) {
-            auto it = _channels.find(channel->Fd());
-            if (it != _channels.end()) {
-                _channels.erase(it);
+            if (HasChannel(channel) == false) {
+                //添加操作还没有提交就被移除了
+                _ctl_avoided++;
+                return;
             }
+            _channels[channel->Fd()] = Entry{NULL, 0};
             Update(channel, EPOLL_CTL_DEL);
         }
+        //某个Channel在同一轮循环中重复修改，被合并掉的修改
+        void CountAvoided() { _ctl_avoided++; }
+        uint64_t CtlCalls() { return _ctl_calls; }
+        uint64_t CtlAvoided() { return _ctl_avoided; }
         //开始监控，返回活跃连接
-        void Poll(std::vector<Channel*> *active) {
+        //timeout为-1表示一直阻塞到有事件就绪，为0表示不阻塞
+        void Poll(std::vector<Channel*> *active, int timeout = -1) {
             // int epoll_wait(int epfd, struct epoll_event *evs, int maxevents, int timeout)
-            int nfds = epoll_wait(_epfd, _evs, MAX_EPOLLEVENTS, -1);
+            int nfds = epoll_wait(_epfd, _evs, MAX_EPOLLEVENTS, timeout);
             if (nfds < 0) {
                 if (errno == EINTR) {
                     return ;
@@ -434,44 +958,392 @@ class Poller {
                 abort();//退出程序
             }
             for (int i = 0; i < nfds; i++) {
-                auto it = _channels.find(_evs[i].data.fd);
-                assert(it != _channels.end());
-                it->second->SetREvents(_evs[i].events);//设置实际就绪的事件
-                active->push_back(it->second);
+                Channel *channel = (Channel *)_evs[i].data.ptr;
+                assert(HasChannel(channel));
+                channel->SetREvents(_evs[i].events);//设置实际就绪的事件
+                active->push_back(channel);
             }
             return;
         }
 };
 
+/*io_uring后端：连接的收发、监听套接字的获取新连接都以请求的形式批量提交，每轮循环只需要一次io_uring_enter*/
+/*eventfd、timerfd等其他描述符仍然通过Channel使用，以POLL_ADD请求模拟水平触发的事件监控*/
+typedef enum { BACKEND_EPOLL, BACKEND_URING }LoopBackend;
+//请求的类型，保存在user_data的低3位
+typedef enum { URING_OP_POLL, URING_OP_RECV, URING_OP_SEND, URING_OP_ACCEPT, URING_OP_CANCEL }UringOp;
+//发起io_uring请求的对象，请求完成之后由它处理结果；请求完成之前对象必须一直有效
+class UringHandler {
+    public:
+        virtual ~UringHandler() {}
+        virtual void OnComplete(UringOp op, int res, uint32_t flags) = 0;
+};
+#define URING_ENTRIES 1024
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 512     //提供给内核的接收缓冲区数量，必须是2的幂
+#define URING_BUF_SIZE 4096     //每个接收缓冲区的大小
+class UringPoller {
+    private:
+        struct Entry {
+            Channel *_channel;  //添加了监控的Channel
+            uint32_t _events;   //已经提交的监控事件
+            uint32_t _gen;      //每次提交POLL_ADD都会增加，用于识别已经过期的完成事件
+            bool _armed;        //是否有还没有完成的POLL_ADD
+            uint32_t _revents;  //本轮收集到的就绪事件
+        };
+        //除了POLL_ADD以外的完成事件，先从完成队列中取出来，Channel的事件处理完之后再统一处理
+        struct Completion {
+            uint64_t _user_data;
+            int _res;
+            uint32_t _flags;
+        };
+        int _ring_fd;
+        unsigned _sq_entries;
+        unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+        unsigned *_cq_head, *_cq_tail, *_cq_mask;
+        struct io_uring_sqe *_sqes;
+        struct io_uring_cqe *_cqes;
+        void *_sq_ptr, *_cq_ptr;
+        size_t _sq_len, _cq_len, _sqes_len;
+        unsigned _sq_local_tail;    //已经填写、还没有提交给内核的提交队列位置
+        //接收缓冲区环，multishot recv从这里挑选缓冲区；环的尾部位置与第一项的保留字段重叠
+        //C++中io_uring_buf_ring::bufs前面多了一个空结构体，偏移和内核不一致，因此直接按照io_uring_buf数组访问
+        struct io_uring_buf *_buf_ring;
+        uint16_t *_buf_ring_tail;
+        char *_bufs;
+        uint16_t _buf_tail;
+        std::vector<Entry> _channels;//以描述符为下标保存添加了监控的Channel
+        std::vector<Completion> _completions;
+        uint64_t _enter_calls;      //io_uring_enter的调用次数
+        uint64_t _sqe_count;        //提交的请求数量
+        uint64_t _update_avoided;   //合并、抵消之后省掉的监控修改次数
+    private:
+        UringPoller():_ring_fd(-1), _sqes(NULL), _sq_ptr(MAP_FAILED), _cq_ptr(MAP_FAILED), _sq_local_tail(0),
+            _buf_ring(NULL), _bufs(NULL), _buf_tail(0), _enter_calls(0), _sqe_count(0), _update_avoided(0) {}
+        static void *Map(size_t len, off_t offset, int fd) {
+            return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        }
+        bool Init() {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            //只有本线程提交请求，内核的后续处理也推迟到本线程调用io_uring_enter时执行，减少中断和上下文切换
+            p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+            _ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+            if (_ring_fd < 0 && errno == EINVAL) {
+                memset(&p, 0, sizeof(p));
+                _ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+            }
+            if (_ring_fd < 0) {
+                ERR_LOG("IO_URING SETUP FAILED:%s", strerror(errno));
+                return false;
+            }
+            _sq_entries = p.sq_entries;
+            _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            _cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP) _sq_len = _cq_len = std::max(_sq_len, _cq_len);
+            _sq_ptr = Map(_sq_len, IORING_OFF_SQ_RING, _ring_fd);
+            if (_sq_ptr == MAP_FAILED) return false;
+            _cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? _sq_ptr : Map(_cq_len, IORING_OFF_CQ_RING, _ring_fd);
+            if (_cq_ptr == MAP_FAILED) return false;
+            _sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+            void *sqes = Map(_sqes_len, IORING_OFF_SQES, _ring_fd);
+            if (sqes == MAP_FAILED) return false;
+            _sqes = (struct io_uring_sqe *)sqes;
+            char *sq = (char *)_sq_ptr, *cq = (char *)_cq_ptr;
+            _sq_head = (unsigned *)(sq + p.sq_off.head);
+            _sq_tail = (unsigned *)(sq + p.sq_off.tail);
+            _sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+            _sq_array = (unsigned *)(sq + p.sq_off.array);
+            _cq_head = (unsigned *)(cq + p.cq_off.head);
+            _cq_tail = (unsigned *)(cq + p.cq_off.tail);
+            _cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+            _cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+            _sq_local_tail = *_sq_tail;
+            return SetupBufRing() && ProbeRecvMultishot();
+        }
+        //接收缓冲区环5.19就有了，multishot recv要到6.0；在一对本地套接字上试一次，内核不支持时返回false，退回到epoll
+        bool ProbeRecvMultishot() {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+                ERR_LOG("IO_URING PROBE SOCKETPAIR FAILED:%s", strerror(errno));
+                return false;
+            }
+            //没有数据可读，recv会一直挂着，马上取消它；支持时recv以ECANCELED结束，不支持时直接以EINVAL结束
+            //请求被拒绝时内核不再提交后面的请求，因此只等recv的最后一个完成事件，取消请求的完成事件以后会被Reap忽略
+            RecvMultishot(fds[0], NULL);
+            Cancel(NULL, URING_OP_RECV);
+            int recv_res = 0;
+            bool done = false;
+            while (done == false) {
+                Enter(1);
+                unsigned head = *_cq_head;
+                unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                    struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+                    if (cqe->user_data != URING_OP_RECV || (cqe->flags & IORING_CQE_F_MORE)) continue;
+                    recv_res = cqe->res;
+                    done = true;
+                }
+                __atomic_store_n(_cq_head, tail, __ATOMIC_RELEASE);
+            }
+            close(fds[0]);
+            close(fds[1]);
+            if (recv_res != -ECANCELED) {
+                ERR_LOG("IO_URING MULTISHOT RECV UNSUPPORTED:%s", strerror(-recv_res));
+                return false;
+            }
+            return true;
+        }
+        //注册接收缓冲区环，并把所有缓冲区交给内核
+        bool SetupBufRing() {
+            void *ring = NULL;
+            if (posix_memalign(&ring, 4096, URING_BUF_COUNT * sizeof(struct io_uring_buf)) != 0) return false;
+            memset(ring, 0, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+            _buf_ring = (struct io_uring_buf *)ring;
+            _buf_ring_tail = &((struct io_uring_buf_ring *)ring)->tail;
+            _bufs = (char *)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+            if (_bufs == NULL) return false;
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = (uint64_t)(uintptr_t)ring;
+            reg.ring_entries = URING_BUF_COUNT;
+            reg.bgid = URING_BUF_GROUP;
+            if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+                ERR_LOG("IO_URING REGISTER PBUF RING FAILED:%s", strerror(errno));
+                return false;
+            }
+            for (int i = 0; i < URING_BUF_COUNT; i++) ReturnBuffer(i);
+            return true;
+        }
+        //获取一个空闲的提交队列项，提交队列满了就先把已经填写的请求提交给内核
+        struct io_uring_sqe *GetSqe() {
+            if (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+                Enter(0);
+                if (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+                    ERR_LOG("IO_URING SUBMISSION QUEUE FULL!");
+                    abort();
+                }
+            }
+            unsigned idx = _sq_local_tail & *_sq_mask;
+            struct io_uring_sqe *sqe = &_sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            _sq_array[idx] = idx;
+            _sq_local_tail++;
+            _sqe_count++;
+            return sqe;
+        }
+        //提交所有已经填写的请求，min_complete大于0时阻塞到至少有这么多个完成事件
+        void Enter(unsigned min_complete) {
+            unsigned submit = _sq_local_tail - *_sq_tail;
+            __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+            _enter_calls++;
+            int ret = syscall(__NR_io_uring_enter, _ring_fd, submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+            //EINTR -- 被信号打断；  EAGAIN/EBUSY -- 完成队列积压，先处理已有的完成事件即可
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                ERR_LOG("IO_URING ENTER FAILED:%s", strerror(errno));
+                abort();
+            }
+        }
+        static uint64_t PollData(int fd, uint32_t gen) {
+            return ((uint64_t)fd << 32) | ((uint64_t)(gen & 0xffffff) << 8) | URING_OP_POLL;
+        }
+        static uint64_t HandlerData(UringHandler *handler, UringOp op) {
+            return (uint64_t)(uintptr_t)handler | op;
+        }
+        void PrepPoll(int fd, Entry &entry) {
+            entry._gen++;
+            entry._armed = true;
+            struct io_uring_sqe *sqe = GetSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = entry._events;
+            sqe->user_data = PollData(fd, entry._gen);
+        }
+        void PrepPollRemove(int fd, Entry &entry) {
+            struct io_uring_sqe *sqe = GetSqe();
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = PollData(fd, entry._gen);
+            sqe->user_data = URING_OP_CANCEL;
+            entry._gen++;//被取消的POLL_ADD的完成事件会被当作过期事件忽略
+            entry._armed = false;
+        }
+        //取出完成队列中的所有完成事件：POLL_ADD的完成事件设置到Channel中，其他的暂存起来
+        int Reap(std::vector<Channel*> *active) {
+            unsigned head = *_cq_head;
+            unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            int count = tail - head;
+            for (; head != tail; head++) {
+                struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+                UringOp op = (UringOp)(cqe->user_data & 7);
+                if (op == URING_OP_CANCEL) continue;
+                if (op != URING_OP_POLL) {
+                    _completions.push_back(Completion{cqe->user_data, cqe->res, cqe->flags});
+                    continue;
+                }
+                int fd = cqe->user_data >> 32;
+                uint32_t gen = (cqe->user_data >> 8) & 0xffffff;
+                if (fd >= (int)_channels.size()) continue;
+                Entry &entry = _channels[fd];
+                if (entry._channel == NULL || (entry._gen & 0xffffff) != gen) continue;
+                if (entry._revents == 0) active->push_back(entry._channel);
+                entry._revents |= cqe->res < 0 ? (uint32_t)EPOLLERR : (uint32_t)cqe->res;
+                //POLL_ADD是一次性的，立即重新提交；本轮事件处理完之后才会提交给内核，如果还有数据没有读完就会马上再次完成，相当于水平触发
+                PrepPoll(fd, entry);
+            }
+            __atomic_store_n(_cq_head, tail, __ATOMIC_RELEASE);
+            for (auto &channel : *active) {
+                Entry &entry = _channels[channel->Fd()];
+                channel->SetREvents(entry._revents);
+                entry._revents = 0;
+            }
+            return count;
+        }
+    public:
+        //创建失败返回NULL，由调用者退回到epoll
+        static UringPoller *Create() {
+            UringPoller *poller = new UringPoller();
+            if (poller->Init()) return poller;
+            delete poller;
+            return NULL;
+        }
+        ~UringPoller() {
+            if (_sqes != NULL) munmap(_sqes, _sqes_len);
+            if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) munmap(_cq_ptr, _cq_len);
+            if (_sq_ptr != MAP_FAILED) munmap(_sq_ptr, _sq_len);
+            if (_ring_fd >= 0) close(_ring_fd);
+            free(_buf_ring);
+            free(_bufs);
+        }
+        /*Channel的事件监控，与Poller的接口一致*/
+        void UpdateEvent(Channel *channel) {
+            int fd = channel->Fd();
+            if (fd >= (int)_channels.size()) _channels.resize(fd + 1, Entry{NULL, 0, 0, false, 0});
+            Entry &entry = _channels[fd];
+            uint32_t events = channel->Events() & ~EPOLLET;
+            if (entry._channel == channel && entry._events == events && (entry._armed || events == 0)) return CountAvoided();
+            if (entry._armed) PrepPollRemove(fd, entry);
+            entry._channel = channel;
+            entry._events = events;
+            if (events != 0) PrepPoll(fd, entry);
+        }
+        void RemoveEvent(Channel *channel) {
+            int fd = channel->Fd();
+            if (fd >= (int)_channels.size() || _channels[fd]._channel != channel) return;
+            Entry &entry = _channels[fd];
+            if (entry._armed) PrepPollRemove(fd, entry);
+            entry._channel = NULL;
+            entry._events = 0;
+            entry._revents = 0;
+        }
+        //提交本轮的请求并等待完成事件，timeout为-1表示一直阻塞到有完成事件，为0表示不阻塞；返回完成事件的数量
+        int Poll(std::vector<Channel*> *active, int timeout = -1) {
+            bool ready = *_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            Enter(timeout < 0 && !ready ? 1 : 0);
+            return Reap(active);
+        }
+        //处理Poll中暂存的收发、获取新连接的完成事件，返回处理的数量
+        size_t DispatchCompletions() {
+            size_t count = _completions.size();
+            for (size_t i = 0; i < count; i++) {
+                Completion &c = _completions[i];
+                UringHandler *handler = (UringHandler *)(uintptr_t)(c._user_data & ~(uint64_t)7);
+                handler->OnComplete((UringOp)(c._user_data & 7), c._res, c._flags);
+            }
+            _completions.clear();
+            return count;
+        }
+        /*以下请求只在本轮循环结束、下一次Poll时统一提交*/
+        //multishot recv：一次提交持续接收，每次有数据就从接收缓冲区环中挑选一个缓冲区，产生一个完成事件
+        void RecvMultishot(int fd, UringHandler *handler) {
+            struct io_uring_sqe *sqe = GetSqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = URING_BUF_GROUP;
+            sqe->user_data = HandlerData(handler, URING_OP_RECV);
+        }
+        //msg以及其中的iovec在请求完成之前必须一直有效
+        void SendMsg(int fd, const struct msghdr *msg, UringHandler *handler) {
+            struct io_uring_sqe *sqe = GetSqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t)msg;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = HandlerData(handler, URING_OP_SEND);
+        }
+        //multishot accept：一次提交持续获取新连接，每个新连接产生一个完成事件
+        void AcceptMultishot(int fd, UringHandler *handler) {
+            struct io_uring_sqe *sqe = GetSqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            sqe->user_data = HandlerData(handler, URING_OP_ACCEPT);
+        }
+        //取消handler发起的op类型的所有请求，按照user_data匹配，描述符已经关闭也可以取消
+        void Cancel(UringHandler *handler, UringOp op) {
+            struct io_uring_sqe *sqe = GetSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = HandlerData(handler, op);
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = URING_OP_CANCEL;
+        }
+        /*接收缓冲区：完成事件的flags中带有缓冲区编号，数据取走之后必须马上归还*/
+        char *Buffer(uint16_t bid) { return _bufs + (size_t)bid * URING_BUF_SIZE; }
+        void ReturnBuffer(uint16_t bid) {
+            struct io_uring_buf *buf = &_buf_ring[_buf_tail & (URING_BUF_COUNT - 1)];
+            buf->addr = (uint64_t)(uintptr_t)Buffer(bid);
+            buf->len = URING_BUF_SIZE;
+            buf->bid = bid;
+            _buf_tail++;
+            __atomic_store_n(_buf_ring_tail, _buf_tail, __ATOMIC_RELEASE);
+        }
+        uint64_t EnterCalls() { return _enter_calls; }
+        uint64_t SqeCount() { return _sqe_count; }
+        void CountAvoided() { _update_avoided++; }
+        uint64_t UpdateAvoided() { return _update_avoided; }
+};
 
-using TaskFunc = std::function<void()>;
-using ReleaseFunc = std::function<void()>;
 class TimerTask{
     private:
         uint64_t _id;       // 定时器任务对象ID
-        uint32_t _timeout;  //定时任务的超时时间
+        uint64_t _timeout;  //定时任务的超时时间，毫秒
         bool _canceled;     // false-表示没有被取消， true-表示被取消
         TaskFunc _task_cb;  //定时器对象要执行的定时任务
         ReleaseFunc _release; //用于删除TimerWheel中保存的定时器对象信息
     public:
-        TimerTask(uint64_t id, uint32_t delay, const TaskFunc &cb): 
-            _id(id), _timeout(delay), _task_cb(cb), _canceled(false) {}
+        TimerTask(uint64_t id, uint64_t delay, TaskFunc cb): 
+            _id(id), _timeout(delay), _task_cb(std::move(cb)), _canceled(false) {}
         ~TimerTask() { 
-            if (_canceled == false) _task_cb(); 
-            _release(); 
+            if (_canceled == false && _task_cb) _task_cb(); 
+            if (_release) _release(); 
         }
         void Cancel() { _canceled = true; }
-        void SetRelease(const ReleaseFunc &cb) { _release = cb; }
-        uint32_t DelayTime() { return _timeout; }
+        void SetRelease(ReleaseFunc cb) { _release = std::move(cb); }
+        uint64_t DelayTime() { return _timeout; }
 };
 
+/*分层时间轮：毫秒、秒、分钟、小时四层，每一层的一格等于下一层转一圈*/
+/*定时任务按照到期时间与当前时间的差值放入能容纳它的最低一层，低一层转完一圈时，才把高一层对应格子中的任务重新分配到低层*/
+/*添加、取消都是O(1)；超出最高层范围的任务先放在最高层，每次被分配时重新计算，因此延迟时间没有上限*/
+/*timerfd只设置为最近可能到期的时间，没有定时任务时停止，空闲的线程不会被定时唤醒*/
+#define TIMER_LEVELS 4
+static const uint64_t timer_level_slots[TIMER_LEVELS] = { 1000, 60, 60, 24 };
+static const uint64_t timer_level_unit[TIMER_LEVELS] = { 1, 1000, 60 * 1000, 3600 * 1000 };//每一层一格的毫秒数
 class TimerWheel {
     private:
         using WeakTask = std::weak_ptr<TimerTask>;
         using PtrTask = std::shared_ptr<TimerTask>;
-        int _tick;      //当前的秒针，走到哪里释放哪里，释放哪里，就相当于执行哪里的任务
-        int _capacity;  //表盘最大数量---其实就是最大延迟时间
-        std::vector<std::vector<PtrTask>> _wheel;
+        struct Entry {
+            uint64_t expire;//到期时间，CLOCK_MONOTONIC的毫秒数
+            PtrTask task;
+        };
+        uint64_t _tick;     //已经处理到的毫秒（CLOCK_MONOTONIC），走到哪里释放哪里，释放哪里，就相当于执行哪里的任务
+        uint64_t _armed;    //timerfd下一次超时的时间，毫秒，UINT64_MAX表示已停止
+        std::vector<std::vector<Entry>> _wheel[TIMER_LEVELS];
+        size_t _count[TIMER_LEVELS];//每一层中的任务数量
+        std::vector<Entry> _expired;//本次到期/需要重新分配的任务，循环复用
         std::unordered_map<uint64_t, WeakTask> _timers;
 
         EventLoop *_loop;
@@ -480,54 +1352,150 @@ class TimerWheel {
     private:
         void RemoveTimer(uint64_t id) {
             auto it = _timers.find(id);
-            if (it != _timers.end()) {
+            //被取消之后同一个ID可能又添加了新的定时任务，只移除已经释放的那个
+            if (it != _timers.end() && it->second.expired()) {
                 _timers.erase(it);
             }
         }
+        static uint64_t NowMs() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        }
+        //delay毫秒之后的到期时间，当前时间向上取整，保证不会提前执行
+        static uint64_t Deadline(uint64_t delay) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t)ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000 + delay;
+        }
         static int CreateTimerfd() {
-            int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+            //超时时间随着定时任务变化，重新设置之后有可能读不到数据，因此使用非阻塞模式
+            int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
             if (timerfd < 0) {
                 ERR_LOG("TIMERFD CREATE FAILED!");
                 abort();
             }
-            //int timerfd_settime(int fd, int flags, struct itimerspec *new, struct itimerspec *old);
-            struct itimerspec itime;
-            itime.it_value.tv_sec = 1;
-            itime.it_value.tv_nsec = 0;//第一次超时时间为1s后
-            itime.it_interval.tv_sec = 1; 
-            itime.it_interval.tv_nsec = 0; //第一次超时后，每次超时的间隔时
-            timerfd_settime(timerfd, 0, &itime, NULL);
             return timerfd;
         }
-        int ReadTimefd() {
+        void ReadTimefd() {
             uint64_t times;
-            //有可能因为其他描述符的事件处理花费事件比较长，然后在处理定时器描述符事件的时候，有可能就已经超时了很多次
-            //read读取到的数据times就是从上一次read之后超时的次数
+            //只是清除可读事件，实际经过的时间以当前时间为准
             int ret = read(_timerfd, &times, 8);
-            if (ret < 0) {
+            if (ret < 0 && errno != EAGAIN && errno != EINTR) {
                 ERR_LOG("READ TIMEFD FAILED!");
                 abort();
             }
-            return times;
         }
-        //这个函数应该每秒钟被执行一次，相当于秒针向后走了一步
-        void RunTimerTask() {
-            _tick = (_tick + 1) % _capacity;
-            _wheel[_tick].clear();//清空指定位置的数组，就会把数组中保存的所有管理定时器对象的shared_ptr释放掉
-        }
-        void OnTime() {
-            //根据实际超时的次数，执行对应的超时任务
-            int times = ReadTimefd();
-            for (int i = 0; i < times; i++) {
-                RunTimerTask();
+        //设置timerfd在expire（绝对时间，毫秒）超时，UINT64_MAX表示停止
+        void Arm(uint64_t expire) {
+            struct itimerspec itime;
+            memset(&itime, 0, sizeof(itime));//全为0表示停止
+            if (expire != UINT64_MAX) {
+                itime.it_value.tv_sec = expire / 1000;
+                itime.it_value.tv_nsec = (expire % 1000) * 1000000;
+            }
+            timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &itime, NULL);
+            _armed = expire;
+        }
+        //每一层找到时间上第一个有任务的格子：毫秒层就是任务的到期时间，高层是这个格子被重新分配的时间，取其中最早的
+        void ArmNext() {
+            uint64_t next = UINT64_MAX;
+            for (int level = TIMER_LEVELS - 1; level >= 0; level--) {
+                if (_count[level] == 0) continue;
+                uint64_t unit = timer_level_unit[level], slots = timer_level_slots[level];
+                for (uint64_t u = _tick / unit + 1; u <= _tick / unit + slots && u * unit < next; u++) {
+                    if (!_wheel[level][u % slots].empty()) { next = u * unit; break; }
+                }
+            }
+            if (next != _armed) Arm(next);
+        }
+        //根据到期时间放入对应层的格子；earliest是可以放入的最早的毫秒，当前格子正在处理时就是下一个毫秒
+        void Insert(Entry &&entry, uint64_t earliest) {
+            uint64_t expire = std::max(entry.expire, earliest);
+            uint64_t diff = expire - _tick;
+            int level = 0;
+            while (level < TIMER_LEVELS - 1 && diff >= timer_level_unit[level + 1]) level++;
+            uint64_t unit = timer_level_unit[level], slots = timer_level_slots[level];
+            //最高层最多放到一圈之后的格子，到时候再重新计算
+            uint64_t u = std::min(expire / unit, _tick / unit + slots);
+            _wheel[level][u % slots].push_back(std::move(entry));
+            _count[level]++;
+            if (u * unit < _armed) Arm(u * unit);//毫秒层是到期时间，高层是重新分配的时间
+        }
+        //把高一层的一个格子中的任务重新分配到低层
+        void Cascade(int level, uint64_t pos) {
+            _expired.swap(_wheel[level][pos]);
+            _count[level] -= _expired.size();
+            for (auto &entry : _expired) Insert(std::move(entry), _tick);//毫秒层的当前格子还没有处理
+            _expired.clear();
+        }
+        //秒针向后走一毫秒：低一层转完一圈时先分配高一层的格子，然后释放毫秒层当前格子中的任务
+        void Step() {
+            _tick++;
+            for (int level = 1; level < TIMER_LEVELS; level++) {
+                if (_tick % timer_level_unit[level] != 0) break;
+                Cascade(level, (_tick / timer_level_unit[level]) % timer_level_slots[level]);
+            }
+            std::vector<Entry> &slot = _wheel[0][_tick % 1000];
+            if (slot.empty()) return;
+            _count[0] -= slot.size();
+            _expired.swap(slot);
+            _expired.clear();//释放管理定时器对象的shared_ptr，最后一个被释放时就会执行定时任务
+        }
+        //处理到now为止到期的任务
+        void Advance(uint64_t now) {
+            while (_tick < now) {
+                //低层都没有任务时，直接跳到最低的有任务的一层下一次重新分配之前，中间的毫秒不需要逐个处理
+                int level = 0;
+                while (level < TIMER_LEVELS && _count[level] == 0) level++;
+                if (level == TIMER_LEVELS) { _tick = now; break; }
+                if (level > 0) {
+                    uint64_t unit = timer_level_unit[level];
+                    _tick = std::max(_tick, std::min(now, (_tick / unit + 1) * unit) - 1);
+                }
+                Step();
             }
         }
-        void TimerAddInLoop(uint64_t id, uint32_t delay, const TaskFunc &cb) {
-            PtrTask pt(new TimerTask(id, delay, cb));
+        void OnTime() {
+            ReadTimefd();
+            //有可能因为其他描述符的事件处理花费事件比较长，已经过去了很多毫秒，一次处理完
+            Advance(NowMs());
+            ArmNext();
+        }
+        //任务是只能移动的，std::bind调用时以左值传入，因此这里接收引用再移动
+        void TimerAddInLoop(uint64_t id, uint64_t delay, TaskFunc &cb) {
+            TimerAtInLoop(id, Deadline(delay), delay, cb);
+        }
+        //在expire（绝对时间，毫秒）执行，delay是刷新时延迟的时间
+        void TimerAtInLoop(uint64_t id, uint64_t expire, uint64_t delay, TaskFunc &cb) {
+            PtrTask pt(new TimerTask(id, delay, std::move(cb)));
             pt->SetRelease(std::bind(&TimerWheel::RemoveTimer, this, id));
-            int pos = (_tick + delay) % _capacity;
-            _wheel[pos].push_back(pt);
             _timers[id] = WeakTask(pt);
+            Insert(Entry{expire, std::move(pt)}, _tick + 1);
+        }
+        //周期任务：每次执行之后用同一个ID添加下一次，执行过程中被取消了就不再添加
+        struct Repeat {
+            TimerWheel *_wheel;
+            uint64_t _id;
+            uint64_t _expire;
+            uint64_t _interval;
+            TaskFunc _cb;
+            void operator()() {
+                _cb();
+                //定时器对象释放之前_timers中的信息还在，被取消时已经移除
+                if (!_wheel->HasTimer(_id)) return;
+                TimerWheel *wheel = _wheel;
+                uint64_t id = _id, interval = _interval;
+                //按照上一次的到期时间计算，不会因为执行的延迟而逐渐推后；落后时只立即补执行一次
+                uint64_t expire = std::max(_expire + interval, NowMs());
+                TaskFunc next(Repeat{wheel, id, expire, interval, std::move(_cb)});
+                wheel->TimerAtInLoop(id, expire, interval, next);
+            }
+        };
+        void TimerEveryInLoop(uint64_t id, uint64_t interval, TaskFunc &cb) {
+            uint64_t expire = Deadline(interval);
+            TaskFunc task(Repeat{this, id, expire, interval, std::move(cb)});
+            TimerAtInLoop(id, expire, interval, task);
         }
         void TimerRefreshInLoop(uint64_t id) {
             //通过保存的定时器对象的weak_ptr构造一个shared_ptr出来，添加到轮子中
@@ -536,9 +1504,8 @@ class TimerWheel {
                 return;//没找着定时任务，没法刷新，没法延迟
             }
             PtrTask pt = it->second.lock();//lock获取weak_ptr管理的对象对应的shared_ptr
-            int delay = pt->DelayTime();
-            int pos = (_tick + delay) % _capacity;
-            _wheel[pos].push_back(pt);
+            uint64_t delay = pt->DelayTime();
+            Insert(Entry{Deadline(delay), std::move(pt)}, _tick + 1);
         }
         void TimerCancelInLoop(uint64_t id) {
             auto it = _timers.find(id);
@@ -547,16 +1514,38 @@ class TimerWheel {
             }
             PtrTask pt = it->second.lock();
             if (pt) pt->Cancel();
+            _timers.erase(it);//取消之后同一个ID可以重新添加
         }
     public:
-        TimerWheel(EventLoop *loop):_capacity(60), _tick(0), _wheel(_capacity), _loop(loop), 
+        TimerWheel(EventLoop *loop):_tick(NowMs()), _armed(UINT64_MAX), _loop(loop),
             _timerfd(CreateTimerfd()), _timer_channel(new Channel(_loop, _timerfd)) {
+            for (int level = 0; level < TIMER_LEVELS; level++) {
+                _wheel[level].resize(timer_level_slots[level]);
+                _count[level] = 0;
+            }
             _timer_channel->SetReadCallback(std::bind(&TimerWheel::OnTime, this));
             _timer_channel->EnableRead();//启动读事件监控
         }
+        //从属线程被回收时EventLoop会被销毁，先清空时间轮（定时器对象释放时还要访问_timers），再关闭描述符
+        //还没有到期的任务全部取消，不再执行：周期任务执行时会向正在销毁的时间轮中添加下一次
+        ~TimerWheel() {
+            for (int level = 0; level < TIMER_LEVELS; level++) {
+                for (auto &slot : _wheel[level]) {
+                    for (auto &entry : slot) entry.task->Cancel();
+                }
+            }
+            _timers.clear();
+            for (int level = 0; level < TIMER_LEVELS; level++) _wheel[level].clear();
+            close(_timerfd);
+        }
         /*定时器中有个_timers成员，定时器信息的操作有可能在多线程中进行，因此需要考虑线程安全问题*/
         /*如果不想加锁，那就把对定期的所有操作，都放到一个线程中进行*/
-        void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb);
+        //delay的单位是毫秒
+        void TimerAdd(uint64_t id, uint64_t delay, TaskFunc cb);
+        //在when（CLOCK_MONOTONIC毫秒）执行
+        void TimerAt(uint64_t id, uint64_t when, TaskFunc cb);
+        //每隔interval毫秒执行一次，直到被取消
+        void TimerEvery(uint64_t id, uint64_t interval, TaskFunc cb);
         //刷新/延迟定时任务
         void TimerRefresh(uint64_t id);
         void TimerCancel(uint64_t id);
@@ -570,28 +1559,172 @@ class TimerWheel {
         }
 };
 
+//多生产者单消费者的无锁任务队列：生产者通过CAS把任务压入链表头部，消费者一次取走整个链表，反转之后按照压入的顺序执行
+class TaskQueue {
+    private:
+        struct Node {
+            TaskFunc _task;
+            Node *_next;
+        };
+        std::atomic<Node *> _head;
+    public:
+        TaskQueue():_head(NULL) {}
+        TaskQueue(const TaskQueue&) = delete;
+        TaskQueue &operator=(const TaskQueue&) = delete;
+        //EventLoop退出之后还没有执行的任务直接丢弃
+        ~TaskQueue() {
+            Node *node = _head.exchange(NULL);
+            while (node) {
+                Node *next = node->_next;
+                delete node;
+                node = next;
+            }
+        }
+        //可以在任意线程中调用
+        void Push(TaskFunc task) {
+            Node *node = new Node{std::move(task), _head.load(std::memory_order_relaxed)};
+            while (!_head.compare_exchange_weak(node->_next, node));
+        }
+        bool Empty() { return _head.load() == NULL; }
+        //只能在消费者线程中调用，取出当前队列中的所有任务，按照压入的顺序追加到out的末尾
+        void PopAll(std::vector<TaskFunc> *out) {
+            Node *node = _head.exchange(NULL);
+            Node *list = NULL;
+            while (node) {
+                Node *next = node->_next;
+                node->_next = list;
+                list = node;
+                node = next;
+            }
+            while (list) {
+                Node *next = list->_next;
+                out->push_back(std::move(list->_task));
+                delete list;
+                list = next;
+            }
+        }
+};
+
+//任务优先级：URGENT-每轮全部执行，不受预算限制； NORMAL-普通任务； BULK-批量任务（例如大量广播），预算用完之后每轮至少执行一个
+typedef enum { TASK_URGENT, TASK_NORMAL, TASK_BULK, TASK_PRIORITIES }TaskPriority;
+#define LOOP_LOAD_WINDOW_US (100 * 1000)
 class EventLoop {
     private:
-        using Functor = std::function<void()>;
+        using Functor = TaskFunc;
         std::thread::id _thread_id;//线程ID
         int _event_fd;//eventfd唤醒IO事件监控有可能导致的阻塞
         std::unique_ptr<Channel> _event_channel;
         Poller _poller;//进行所有描述符的事件监控
-        std::vector<Functor> _tasks;//任务池
-        std::mutex _mutex;//实现任务池操作的线程安全
+        std::unique_ptr<UringPoller> _uring;//使用io_uring后端时代替_poller，为空表示使用epoll
+        std::vector<Channel *> _actives;//每次事件监控得到的活跃连接，循环复用，避免每轮都重新申请空间
+        std::vector<Channel *> _updates;//本轮循环中修改了监控事件、还没有提交给epoll的Channel
+        std::vector<Functor> _corks;//本轮循环中合并了待发送数据、需要在下一次epoll_wait之前统一发送的连接
+        BlockPool _block_pool;//本线程内所有连接缓冲区共用的内存块池
+        FramePool _frame_pool;//本线程内协程帧的缓存
+        std::atomic<uint64_t> _timer_seq;//RunAt/RunAfter/RunEvery以及协程Sleep使用的定时器ID序号
+        /*任务池，每个优先级一组*/
+        TaskQueue _tasks[TASK_PRIORITIES];//其他线程压入的任务，无锁队列
+        std::vector<Functor> _local_tasks[TASK_PRIORITIES];//本线程压入的任务，不需要经过无锁队列，也不需要为每个任务申请链表节点
+        std::vector<Functor> _pending_tasks[TASK_PRIORITIES];//等待执行的任务，包括上一轮预算用完之后推迟的任务
+        size_t _pending_head[TASK_PRIORITIES];//_pending_tasks中下一个要执行的任务
+        uint64_t _task_budget;      //每轮最多执行的普通/批量任务数量，0表示不限制
+        uint64_t _task_budget_us;   //每轮执行普通/批量任务的最长时间，0表示不限制
+        std::atomic<uint64_t> _deferred_count;//因为预算用完而推迟到下一轮执行的任务次数
+        std::atomic<uint64_t> _max_task_us;  //单个任务的最长执行时间
         TimerWheel _timer_wheel;//定时器模块
+        /*负载统计，由其他线程读取，用于决定新连接分配到哪个EventLoop*/
+        std::atomic<int> _conn_count;       //本线程中的连接数量
+        std::atomic<int> _conn_refs;        //所属EventLoop是本线程的连接对象数量，包括已经释放、还没有析构的
+        std::atomic<uint64_t> _enqueue_count;//压入任务池的任务数量
+        std::atomic<uint64_t> _dequeue_count;//已经执行的任务数量，只在本线程中修改
+        std::atomic<uint64_t> _wakeup_count;//实际写eventfd唤醒的次数
+        std::atomic<bool> _polling;         //是否阻塞（或即将阻塞）在epoll_wait中
+        std::atomic<bool> _wakeup_pending;  //本轮epoll_wait是否已经有生产者写过eventfd
+        std::atomic<uint32_t> _busy_ratio;  //最近一段时间内处理事件和任务所占的时间比例，千分比
+        std::atomic<uint64_t> _busy_stamp;  //最近一次统计繁忙比例的时间
+        std::atomic<bool> _quit;            //是否退出事件循环
+        uint64_t _window_start;             //当前统计窗口的开始时间
+        uint64_t _window_busy;              //当前统计窗口内处理事件和任务的时间
+        /*忙轮询模式：有事件或任务处理之后的一段时间内，以0超时反复调用epoll_wait，不进入睡眠，用CPU换取更低的延迟*/
+        uint64_t _busy_poll_us;             //处理完事件或任务之后继续忙轮询的时间，0表示不启用
+        int _busy_poll_sock_us;             //本线程中连接套接字的SO_BUSY_POLL时间，0表示不设置
+        uint64_t _last_active;              //最近一次处理事件或任务的时间
+        uint64_t _loop_ms;                  //本轮循环开始处理事件的时间（毫秒），连接记录活跃时间时使用，避免每个事件都读取时钟
     public:
         //执行任务池中的所有任务
-        void RunAllTask() {
-            std::vector<Functor> functor;
-            {
-                std::unique_lock<std::mutex> _lock(_mutex);
-                _tasks.swap(functor);
+        //执行本轮循环中登记的合并发送操作
+        void RunAllCork() {
+            if (_corks.empty()) return;//没有登记时直接返回，否则下面的交换会丢掉_corks已经申请的空间
+            std::vector<Functor> corks;
+            //发送过程中可能又有新的登记，必须在epoll_wait之前全部执行完
+            while (!_corks.empty()) {
+                corks.swap(_corks);
+                for (auto &f : corks) {
+                    f();
+                }
+                corks.clear();
             }
-            for (auto &f : functor) {
-                f();
+            _corks.swap(corks);//交还内存，避免下一轮重新申请
+        }
+        //按照优先级执行任务：紧急任务全部执行，普通任务和批量任务共用每轮的数量/时间预算，用完之后剩下的推迟到下一轮
+        //执行过程中新压入的任务也留到下一轮执行
+        uint64_t RunAllTask() {
+            for (int prio = 0; prio < TASK_PRIORITIES; prio++) {
+                _tasks[prio].PopAll(&_pending_tasks[prio]);
+                for (auto &f : _local_tasks[prio]) _pending_tasks[prio].push_back(std::move(f));
+                _local_tasks[prio].clear();
             }
-            return ;
+            uint64_t now = MonotonicUs();
+            uint64_t deadline = _task_budget_us > 0 ? now + _task_budget_us : 0;
+            uint64_t limit = _task_budget > 0 ? _task_budget : UINT64_MAX;
+            uint64_t count = RunTasks(TASK_URGENT, UINT64_MAX, 0, &now);
+            uint64_t used = RunTasks(TASK_NORMAL, limit, deadline, &now);
+            bool exhausted = used >= limit || (deadline > 0 && now >= deadline);
+            //批量任务不能被普通任务一直饿着，每轮至少执行一个
+            used += RunTasks(TASK_BULK, exhausted ? 1 : limit - used, deadline, &now);
+            count += used;
+            for (int prio = 0; prio < TASK_PRIORITIES; prio++) {
+                std::vector<Functor> &tasks = _pending_tasks[prio];
+                size_t &head = _pending_head[prio];
+                //剩下的任务移到数组开头，下一轮继续执行
+                if (head < tasks.size()) _deferred_count.store(_deferred_count.load(std::memory_order_relaxed) + tasks.size() - head, std::memory_order_relaxed);
+                tasks.erase(tasks.begin(), tasks.begin() + head);
+                head = 0;
+            }
+            if (count > 0) _dequeue_count.store(_dequeue_count.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+            return count;
+        }
+        //执行一个优先级中最多limit个任务，到了deadline就停止（至少执行一个），返回执行的数量；now传入并返回当前时间
+        uint64_t RunTasks(int prio, uint64_t limit, uint64_t deadline, uint64_t *now) {
+            std::vector<Functor> &tasks = _pending_tasks[prio];
+            size_t &head = _pending_head[prio];
+            uint64_t count = 0;
+            while (head < tasks.size() && count < limit) {
+                uint64_t start = *now;
+                tasks[head]();
+                tasks[head] = nullptr;//尽早释放任务中持有的资源
+                head++;
+                count++;
+                *now = MonotonicUs();
+                if (*now - start > _max_task_us.load(std::memory_order_relaxed)) _max_task_us.store(*now - start, std::memory_order_relaxed);
+                if (deadline > 0 && *now >= deadline) break;
+            }
+            return count;
+        }
+        //是否还有等待执行的任务，有的话本轮不能阻塞在epoll_wait中
+        bool HasPendingTask() {
+            for (int prio = 0; prio < TASK_PRIORITIES; prio++) {
+                if (!_tasks[prio].Empty() || !_local_tasks[prio].empty() || _pending_head[prio] < _pending_tasks[prio].size()) return true;
+            }
+            return false;
+        }
+        void EnableBusyPollInLoop(uint64_t spin_us, int sock_us) {
+            _busy_poll_us = spin_us;
+            _busy_poll_sock_us = sock_us;
+        }
+        void SetTaskBudgetInLoop(uint64_t count, uint64_t us) {
+            _task_budget = count;
+            _task_budget_us = us;
         }
         static int CreateEventFd() {
             int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
@@ -614,6 +1747,31 @@ class EventLoop {
             }
             return ;
         }
+        uint64_t NextTimerId() { return (1ULL << 63) | _timer_seq.fetch_add(1, std::memory_order_relaxed); }
+        static EventLoop *&CurrentRef() {
+            static thread_local EventLoop *loop = NULL;
+            return loop;
+        }
+        static uint64_t MonotonicUs() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        }
+        //累计一轮循环中处理事件和任务的时间，每个统计窗口结束时更新繁忙比例（与上一个窗口取平均，避免抖动）
+        void AccountBusy(uint64_t start, uint64_t end) {
+            _window_busy += end - start;
+            if (end - _window_start < LOOP_LOAD_WINDOW_US) return;
+            uint32_t ratio = _window_busy * 1000 / (end - _window_start);
+            _busy_ratio = (_busy_ratio + ratio) / 2;
+            _busy_stamp = end;
+            _window_start = end;
+            _window_busy = 0;
+        }
+        //提交本轮的监控修改以及io_uring请求，等待事件就绪
+        void Poll(int timeout) {
+            if (_uring) _uring->Poll(&_actives, timeout);
+            else _poller.Poll(&_actives, timeout);
+        }
         void WeakUpEventFd() {
             uint64_t val = 1;
             int ret = write(_event_fd, &val, sizeof(val));
@@ -627,29 +1785,72 @@ class EventLoop {
             return ;
         }
     public:
-        EventLoop():_thread_id(std::this_thread::get_id()), 
+        //backend只在构造时选择，io_uring不可用（内核版本过低、被禁用）时退回到epoll
+        EventLoop(LoopBackend backend = BACKEND_EPOLL):_thread_id(std::this_thread::get_id()), 
                     _event_fd(CreateEventFd()), 
                     _event_channel(new Channel(this, _event_fd)),
-                    _timer_wheel(this) {
+                    _uring(backend == BACKEND_URING ? UringPoller::Create() : NULL),
+                    _timer_seq(0),
+                    _task_budget(0), _task_budget_us(0), _deferred_count(0), _max_task_us(0),
+                    _timer_wheel(this),
+                    _conn_count(0), _conn_refs(0), _enqueue_count(0), _dequeue_count(0), _wakeup_count(0), 
+                    _polling(false), _wakeup_pending(false), _busy_ratio(0),
+                    _busy_stamp(MonotonicUs()), _quit(false), _window_start(_busy_stamp), _window_busy(0),
+                    _busy_poll_us(0), _busy_poll_sock_us(0), _last_active(0), _loop_ms(MonotonicUs() / 1000) {
+            for (int prio = 0; prio < TASK_PRIORITIES; prio++) _pending_head[prio] = 0;
+            CurrentRef() = this;
+            if (backend == BACKEND_URING && !_uring) ERR_LOG("IO_URING UNAVAILABLE, FALL BACK TO EPOLL!");
             //给eventfd添加可读事件回调函数，读取eventfd事件通知次数
             _event_channel->SetReadCallback(std::bind(&EventLoop::ReadEventfd, this));
             //启动eventfd的读事件监控
             _event_channel->EnableRead();
         }
+        ~EventLoop() {
+            if (CurrentRef() == this) CurrentRef() = NULL;
+            close(_event_fd);
+        }
+        //当前线程中的EventLoop，没有则返回NULL
+        static EventLoop *Current() { return CurrentRef(); }
         //三步走--事件监控-》就绪事件处理-》执行任务
         void Start() {
-            while(1) {
+            while(!_quit) {
+                //0. 统一提交上一轮中的监控事件修改
+                FlushUpdates();
                 //1. 事件监控， 
-                std::vector<Channel *> actives;
-                _poller.Poll(&actives);
+                _actives.clear();
+                if (_busy_poll_us > 0 && MonotonicUs() - _last_active < _busy_poll_us) {
+                    //忙轮询期间不会阻塞，也就不需要生产者唤醒，下一次调用之前就会检查任务池
+                    Poll(0);
+                }else {
+                    //先声明即将阻塞，再检查任务池：与QueueInLoop中先压入任务、再检查是否阻塞的顺序相对应，
+                    //两边至少有一边能看到对方的修改，要么这里不阻塞，要么生产者写eventfd唤醒，任务不会被遗漏
+                    _wakeup_pending = false;
+                    _polling = true;
+                    Poll(HasPendingTask() ? 0 : -1);
+                    _polling = false;
+                }
+                uint64_t busy_start = MonotonicUs();
+                _loop_ms = busy_start / 1000;
                 //2. 事件处理。 
-                for (auto &channel : actives) {
+                for (auto &channel : _actives) {
                     channel->HandleEvent();
                 }
+                //   io_uring后端下连接的收发、获取新连接的完成事件
+                size_t completions = _uring ? _uring->DispatchCompletions() : 0;
                 //3. 执行任务
-                RunAllTask();
+                uint64_t tasks = RunAllTask();
+                //4. 合并发送本轮中各个连接积攒的数据
+                RunAllCork();
+                uint64_t busy_end = MonotonicUs();
+                AccountBusy(busy_start, busy_end);
+                if (!_actives.empty() || completions > 0 || tasks > 0) _last_active = busy_end;
             }
         }
+        //退出事件循环，可以在任意线程中调用，当前这一轮循环执行完毕后Start返回
+        void Quit() {
+            _quit = true;
+            WeakUpEventFd();
+        }
         //用于判断当前线程是否是EventLoop对应的线程；
         bool IsInLoop() {
             return (_thread_id == std::this_thread::get_id());
@@ -658,42 +1859,274 @@ class EventLoop {
             assert(_thread_id == std::this_thread::get_id());
         }
         //判断将要执行的任务是否处于当前线程中，如果是则执行，不是则压入队列。
-        void RunInLoop(const Functor &cb) {
+        void RunInLoop(Functor cb, TaskPriority prio = TASK_NORMAL) {
             if (IsInLoop()) {
                 return cb();
             }
-            return QueueInLoop(cb);
+            return QueueInLoop(std::move(cb), prio);
         }
         //将操作压入任务池
-        void QueueInLoop(const Functor &cb) {
-            {
-                std::unique_lock<std::mutex> _lock(_mutex);
-                _tasks.push_back(cb);
+        void QueueInLoop(Functor cb, TaskPriority prio = TASK_NORMAL) {
+            _enqueue_count.fetch_add(1, std::memory_order_relaxed);
+            if (IsInLoop()) return _local_tasks[prio].push_back(std::move(cb));
+            _tasks[prio].Push(std::move(cb));
+            //唤醒有可能因为没有事件就绪，而导致的epoll阻塞；其实就是给eventfd写入一个数据，eventfd就会触发可读事件
+            //EventLoop正在处理事件或任务时（包括在本线程中压入任务）不需要唤醒，本轮结束之前会检查任务池；
+            //多个生产者同时压入时，一次epoll_wait只需要唤醒一次
+            if (_polling && !_wakeup_pending.exchange(true)) {
+                _wakeup_count.fetch_add(1, std::memory_order_relaxed);
+                WeakUpEventFd();
             }
-            //唤醒有可能因为没有事件就绪，而导致的epoll阻塞；
-            //其实就是给eventfd写入一个数据，eventfd就会触发可读事件
-            WeakUpEventFd();
         }
-        //添加/修改描述符的事件监控
-        void UpdateEvent(Channel *channel) { return _poller.UpdateEvent(channel); }
-        //移除描述符的监控
-        void RemoveEvent(Channel *channel) { return _poller.RemoveEvent(channel); }
-        void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb) { return _timer_wheel.TimerAdd(id, delay, cb); }
+        //添加/修改描述符的事件监控，只做记录，每轮循环统一提交一次
+        void UpdateEvent(Channel *channel) {
+            if (channel->Dirty()) {
+                if (_uring) return _uring->CountAvoided();
+                return _poller.CountAvoided();
+            }
+            channel->SetDirty(true);
+            _updates.push_back(channel);
+        }
+        //移除描述符的监控，移除之后描述符马上就会被关闭，因此需要立即生效
+        void RemoveEvent(Channel *channel) {
+            if (channel->Dirty()) {
+                channel->SetDirty(false);
+                _updates.erase(std::find(_updates.begin(), _updates.end(), channel));
+            }
+            if (_uring) return _uring->RemoveEvent(channel);
+            return _poller.RemoveEvent(channel);
+        }
+        //提交记录下来的监控事件修改
+        void FlushUpdates() {
+            for (auto &channel : _updates) {
+                channel->SetDirty(false);
+                if (_uring) _uring->UpdateEvent(channel);
+                else _poller.UpdateEvent(channel);
+            }
+            _updates.clear();
+        }
+        //epoll_ctl的调用统计：实际调用次数，以及合并之后省掉的次数；io_uring后端统计的是省掉的POLL_ADD/POLL_REMOVE
+        uint64_t CtlCalls() { return _poller.CtlCalls(); }
+        uint64_t CtlAvoided() { return _uring ? _uring->UpdateAvoided() : _poller.CtlAvoided(); }
+        //登记一个合并发送操作，在本轮任务执行完毕、下一次epoll_wait之前执行
+        void QueueCork(Functor cb) { AssertInLoop(); _corks.push_back(std::move(cb)); }
+        //获取内存块池，只能在EventLoop线程中使用
+        BlockPool *GetBlockPool() { return &_block_pool; }
+        //使用io_uring后端时返回io_uring，否则返回NULL；请求只能在EventLoop线程中提交
+        UringPoller *Uring() { return _uring.get(); }
+        //获取协程帧池，只能在EventLoop线程中使用
+        FramePool *GetFramePool() { return &_frame_pool; }
+#if defined(__cpp_impl_coroutine)
+        class SleepAwaiter;
+        //co_await loop.Sleep(ms)：挂起当前协程，ms毫秒之后在本线程中恢复（精度为定时器的精度），0表示让出到本轮任务阶段
+        //连接可能被迁移到其他EventLoop，连接的处理协程使用Connection::Sleep
+        SleepAwaiter Sleep(uint64_t ms);
+#endif
+        //delay的单位是毫秒
+        void TimerAdd(uint64_t id, uint64_t delay, TaskFunc cb) { return _timer_wheel.TimerAdd(id, delay, std::move(cb)); }
         void TimerRefresh(uint64_t id) { return _timer_wheel.TimerRefresh(id); }
         void TimerCancel(uint64_t id) { return _timer_wheel.TimerCancel(id); }
         bool HasTimer(uint64_t id) { return _timer_wheel.HasTimer(id); }
+        /*通用定时任务，可以在任意线程中调用，返回的ID用于TimerCancel取消*/
+        /*EventLoop自己分配的ID最高位为1，与TimerAdd使用的连接ID区分开*/
+        //在when（CLOCK_MONOTONIC毫秒，即MonotonicUs()/1000）执行
+        uint64_t RunAt(uint64_t when, TaskFunc cb) {
+            uint64_t id = NextTimerId();
+            _timer_wheel.TimerAt(id, when, std::move(cb));
+            return id;
+        }
+        //delay毫秒之后执行
+        uint64_t RunAfter(uint64_t delay, TaskFunc cb) {
+            uint64_t id = NextTimerId();
+            _timer_wheel.TimerAdd(id, delay, std::move(cb));
+            return id;
+        }
+        //每隔interval毫秒执行一次，直到被取消
+        uint64_t RunEvery(uint64_t interval, TaskFunc cb) {
+            uint64_t id = NextTimerId();
+            _timer_wheel.TimerEvery(id, interval, std::move(cb));
+            return id;
+        }
+        /*以下负载统计接口可以在任意线程中调用*/
+        //连接创建/释放时增减本线程的连接数量
+        void AddConnCount(int delta) { _conn_count += delta; }
+        int ConnCount() { return _conn_count; }
+        //连接对象构造/析构/迁移时增减；连接对象析构之前都可能访问所属的EventLoop，为0之后EventLoop才能销毁
+        void AddConnRef(int delta) { _conn_refs += delta; }
+        int ConnRefs() { return _conn_refs; }
+        //两个计数分别读取，其他线程中可能读到执行数大于压入数，因此不小于0
+        int TaskCount() {
+            int64_t count = (int64_t)(_enqueue_count.load(std::memory_order_relaxed) - _dequeue_count.load(std::memory_order_relaxed));
+            return (int)std::max<int64_t>(0, count);
+        }
+        //任务池统计：压入的任务数量，以及实际写eventfd唤醒的次数
+        uint64_t EnqueueCount() { return _enqueue_count.load(std::memory_order_relaxed); }
+        uint64_t WakeupCount() { return _wakeup_count.load(std::memory_order_relaxed); }
+        //因为预算用完而推迟到下一轮执行的任务次数，以及单个任务的最长执行时间（微秒）
+        uint64_t DeferredCount() { return _deferred_count.load(std::memory_order_relaxed); }
+        uint64_t MaxTaskUs() { return _max_task_us.load(std::memory_order_relaxed); }
+        //启动忙轮询模式：处理完事件或任务之后的spin_us微秒内不进入睡眠，适合独占CPU、对尾延迟敏感的线程
+        //sock_us大于0时，本线程中的连接套接字还会设置SO_BUSY_POLL，在驱动中轮询接收队列
+        void EnableBusyPoll(uint64_t spin_us, int sock_us = 0) {
+            RunInLoop(std::bind(&EventLoop::EnableBusyPollInLoop, this, spin_us, sock_us), TASK_URGENT);
+        }
+        //本线程中连接套接字需要设置的SO_BUSY_POLL时间，只能在本线程中调用
+        int BusyPollSocketUs() { return _busy_poll_sock_us; }
+        //本轮循环开始处理事件的时间（CLOCK_MONOTONIC毫秒），只能在本线程中调用
+        uint64_t LoopMs() { return _loop_ms; }
+        //设置每轮执行普通/批量任务的预算：最多count个、最长us微秒，0表示不限制；紧急任务不受限制
+        void SetTaskBudget(uint64_t count, uint64_t us) {
+            RunInLoop(std::bind(&EventLoop::SetTaskBudgetInLoop, this, count, us), TASK_URGENT);
+        }
+        //最近的繁忙比例（千分比）；一直阻塞在epoll_wait中时，按照空闲的时长衰减
+        uint32_t BusyRatio() {
+            uint32_t ratio = _busy_ratio;
+            uint64_t idle = MonotonicUs() - _busy_stamp;
+            if (_polling && idle > LOOP_LOAD_WINDOW_US) ratio = ratio * LOOP_LOAD_WINDOW_US / idle;
+            return ratio;
+        }
 };
+#if defined(__cpp_impl_coroutine)
+/*协程：处理函数可以按照顺序编写，co_await挂起的协程由所属的EventLoop在条件满足时恢复，不需要额外的线程*/
+/*CoTask<T>是惰性启动的协程，可以被其他协程co_await，也可以通过Detach启动后独立运行，结束时自动释放*/
+class CoPromiseBase {
+    public:
+        std::coroutine_handle<> _continuation;//co_await这个协程的上层协程，结束时恢复它
+        bool _detached = false;
+        std::exception_ptr _exception;
+    public:
+        //协程帧从当前线程EventLoop的帧池中申请，不在EventLoop线程中则直接向系统申请
+        static void *operator new(size_t size) {
+            EventLoop *loop = EventLoop::Current();
+            return loop ? loop->GetFramePool()->Alloc(size) : FramePool::RawAlloc(size);
+        }
+        static void operator delete(void *frame, size_t size) {
+            EventLoop *loop = EventLoop::Current();
+            if (loop) return loop->GetFramePool()->Free(frame, size);
+            ::operator delete(frame);
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            template<typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                CoPromiseBase &promise = handle.promise();
+                if (promise._continuation) return promise._continuation;
+                if (promise._detached) {
+                    promise.LogException();
+                    handle.destroy();
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        //异常先保存下来，由co_await的上层协程重新抛出；独立运行的协程没有人接收，结束时记录日志并释放协程帧
+        void unhandled_exception() { _exception = std::current_exception(); }
+        void Rethrow() { if (_exception) std::rethrow_exception(_exception); }
+        void LogException() noexcept {
+            if (!_exception) return;
+            try { std::rethrow_exception(_exception); }
+            catch (const std::exception &e) { ERR_LOG("DETACHED COROUTINE EXCEPTION:%s", e.what()); }
+            catch (...) { ERR_LOG("DETACHED COROUTINE EXCEPTION!"); }
+        }
+};
+template<typename T>
+class CoPromise : public CoPromiseBase {
+    public:
+        std::optional<T> _value;
+        template<typename U>
+        void return_value(U &&value) { _value = std::forward<U>(value); }
+        T Result() { Rethrow(); return std::move(*_value); }
+};
+template<>
+class CoPromise<void> : public CoPromiseBase {
+    public:
+        void return_void() {}
+        void Result() { Rethrow(); }
+};
+template<typename T = void>
+class CoTask {
+    public:
+        class promise_type : public CoPromise<T> {
+            public:
+                CoTask get_return_object() { return CoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        };
+    private:
+        std::coroutine_handle<promise_type> _handle;
+        explicit CoTask(std::coroutine_handle<promise_type> handle):_handle(handle) {}
+    public:
+        CoTask(CoTask &&other) noexcept :_handle(other._handle) { other._handle = nullptr; }
+        CoTask(const CoTask&) = delete;
+        CoTask &operator=(const CoTask&) = delete;
+        ~CoTask() { if (_handle) _handle.destroy(); }
+        //启动协程并交出所有权，协程结束时自己释放帧
+        void Detach() {
+            std::coroutine_handle<promise_type> handle = _handle;
+            _handle = nullptr;
+            handle.promise()._detached = true;
+            handle.resume();
+        }
+        /*co_await一个CoTask：启动它，结束之后恢复当前协程并取得返回值*/
+        bool await_ready() { return !_handle || _handle.done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+            _handle.promise()._continuation = caller;
+            return _handle;
+        }
+        T await_resume() { return _handle.promise().Result(); }
+};
+class EventLoop::SleepAwaiter {
+    private:
+        EventLoop *_loop;
+        uint64_t _ms;
+    public:
+        SleepAwaiter(EventLoop *loop, uint64_t ms):_loop(loop), _ms(ms) {}
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            _loop->AssertInLoop();
+            if (_ms == 0) return _loop->QueueInLoop([handle]() { handle.resume(); });
+            _loop->RunAfter(_ms, [handle]() { handle.resume(); });
+        }
+        void await_resume() {}
+};
+inline EventLoop::SleepAwaiter EventLoop::Sleep(uint64_t ms) { return SleepAwaiter(this, ms); }
+#endif
+#define MPOL_LOCAL_POLICY 4 //set_mempolicy的MPOL_LOCAL，从当前运行的CPU所在的NUMA节点分配内存
 class LoopThread {
     private:
         /*用于实现_loop获取的同步关系，避免线程创建了，但是_loop还没有实例化之前去获取_loop*/
         std::mutex _mutex;          // 互斥锁
         std::condition_variable _cond;   // 条件变量
         EventLoop *_loop;       // EventLoop指针变量，这个对象需要在线程内实例化
+        std::string _name;      // 线程名称，为空则不设置
+        std::vector<int> _cpus; // 线程绑定的CPU，为空则不绑定
+        bool _numa_local;       // 是否从线程所在的NUMA节点分配内存
+        LoopBackend _backend;   // EventLoop使用的事件监控后端
         std::thread _thread;    // EventLoop对应的线程
     private:
+        /*线程名称、CPU绑定、内存分配策略都必须在EventLoop实例化之前设置，EventLoop及其内存块池的内存才会落在本地节点上*/
+        void SetupThread() {
+            if (!_name.empty()) {
+                //线程名称最长15个字符
+                pthread_setname_np(pthread_self(), _name.substr(0, 15).c_str());
+            }
+            if (!_cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : _cpus) CPU_SET(cpu, &set);
+                if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                    ERR_LOG("SET THREAD AFFINITY FAILED!");
+                }
+            }
+            //进程可能被numactl等设置了交错分配之类的策略，这里显式改为本地分配
+            if (_numa_local && syscall(SYS_set_mempolicy, MPOL_LOCAL_POLICY, NULL, 0) < 0) {
+                ERR_LOG("SET MEMPOLICY FAILED:%s", strerror(errno));
+            }
+        }
         /*实例化 EventLoop 对象，唤醒_cond上有可能阻塞的线程，并且开始运行EventLoop模块的功能*/
         void ThreadEntry() {
-            EventLoop loop;
+            SetupThread();
+            EventLoop loop(_backend);
             {
                 std::unique_lock<std::mutex> lock(_mutex);//加锁
                 _loop = &loop;
@@ -703,7 +2136,18 @@ class LoopThread {
         }
     public:
         /*创建线程，设定线程入口函数*/
-        LoopThread():_loop(NULL), _thread(std::thread(&LoopThread::ThreadEntry, this)) {}
+        LoopThread(const std::string &name = "", const std::vector<int> &cpus = std::vector<int>(), bool numa_local = false,
+            LoopBackend backend = BACKEND_EPOLL):
+            _loop(NULL), _name(name), _cpus(cpus), _numa_local(numa_local), _backend(backend),
+            _thread(std::thread(&LoopThread::ThreadEntry, this)) {}
+        /*退出事件循环并等待线程结束，线程结束之后EventLoop对象也就销毁了*/
+        void Stop() {
+            if (!_thread.joinable()) return;
+            GetLoop()->Quit();
+            _thread.join();
+        }
+        //还在运行的线程对象析构会导致进程退出，因此先停止
+        ~LoopThread() { Stop(); }
         /*返回当前线程关联的EventLoop对象指针*/
         EventLoop *GetLoop() {
             EventLoop *loop = NULL;
@@ -716,33 +2160,225 @@ class LoopThread {
         }
 };
 
+//新连接分配到哪个从属EventLoop的策略，只在主线程中调用
+class LoopSelector {
+    public:
+        virtual ~LoopSelector() {}
+        //为描述符fd对应的新连接从loops中选择一个EventLoop，loops不会为空
+        virtual EventLoop *Select(const std::vector<EventLoop *> &loops, int fd) = 0;
+};
+//轮询分配
+class RoundRobinSelector : public LoopSelector {
+    private:
+        size_t _next_idx;
+    public:
+        RoundRobinSelector():_next_idx(0) {}
+        virtual EventLoop *Select(const std::vector<EventLoop *> &loops, int /*fd*/) {
+            _next_idx = (_next_idx + 1) % loops.size();
+            return loops[_next_idx];
+        }
+};
+//分配给当前连接数量最少的EventLoop，适合长连接且各连接负载差不多的场景
+class LeastConnSelector : public LoopSelector {
+    public:
+        virtual EventLoop *Select(const std::vector<EventLoop *> &loops, int /*fd*/) {
+            EventLoop *best = loops[0];
+            for (size_t i = 1; i < loops.size(); i++) {
+                if (loops[i]->ConnCount() < best->ConnCount()) best = loops[i];
+            }
+            return best;
+        }
+};
+//随机选出两个EventLoop，分配给负载较低的那个：不需要遍历所有线程，也避免所有新连接同时涌向同一个最空闲的线程
+class TwoChoicesSelector : public LoopSelector {
+    private:
+        std::minstd_rand _rand;
+    private:
+        //负载由连接数量、等待执行的任务数量共同决定，再按照繁忙比例加权
+        static uint64_t Load(EventLoop *loop) {
+            uint64_t count = loop->ConnCount() + loop->TaskCount() + 1;
+            return count * (1000 + loop->BusyRatio());
+        }
+    public:
+        TwoChoicesSelector():_rand(std::random_device()()) {}
+        virtual EventLoop *Select(const std::vector<EventLoop *> &loops, int /*fd*/) {
+            if (loops.size() == 1) return loops[0];
+            size_t a = _rand() % loops.size();
+            size_t b = _rand() % (loops.size() - 1);
+            if (b >= a) b++;
+            return Load(loops[a]) <= Load(loops[b]) ? loops[a] : loops[b];
+        }
+};
+//按照客户端IP做一致性哈希，同一个客户端的连接总是落在同一个EventLoop上，EventLoop增减时只有少部分客户端会改变
+#define HASH_VIRTUAL_NODES 64
+class IpHashSelector : public LoopSelector {
+    private:
+        std::vector<EventLoop *> _loops;//构建哈希环时的EventLoop，发生变化时重新构建
+        std::vector<std::pair<uint64_t, EventLoop *>> _ring;//按照哈希值排序的虚拟节点
+    private:
+        static uint64_t Hash(uint64_t x) {
+            x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+            x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+            x ^= x >> 33;
+            return x;
+        }
+        static uint64_t PeerHash(int fd) {
+            struct sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            if (getpeername(fd, (struct sockaddr*)&addr, &len) < 0) return Hash(fd);
+            if (addr.ss_family == AF_INET) {
+                return Hash(((struct sockaddr_in*)&addr)->sin_addr.s_addr);
+            }
+            const uint64_t *ip6 = (const uint64_t *)&((struct sockaddr_in6*)&addr)->sin6_addr;
+            return Hash(ip6[0] ^ Hash(ip6[1]));
+        }
+        //虚拟节点的位置由EventLoop的地址决定，与它在数组中的下标无关
+        void BuildRing(const std::vector<EventLoop *> &loops) {
+            _loops = loops;
+            _ring.clear();
+            for (EventLoop *loop : loops) {
+                for (int i = 0; i < HASH_VIRTUAL_NODES; i++) {
+                    _ring.push_back(std::make_pair(Hash((uint64_t)(uintptr_t)loop * HASH_VIRTUAL_NODES + i), loop));
+                }
+            }
+            std::sort(_ring.begin(), _ring.end());
+        }
+    public:
+        virtual EventLoop *Select(const std::vector<EventLoop *> &loops, int fd) {
+            if (loops != _loops) BuildRing(loops);
+            uint64_t h = PeerHash(fd);
+            auto it = std::lower_bound(_ring.begin(), _ring.end(), std::make_pair(h, (EventLoop *)NULL));
+            if (it == _ring.end()) it = _ring.begin();
+            return it->second;
+        }
+};
+typedef enum { ROUND_ROBIN, LEAST_CONNECTIONS, TWO_CHOICES, IP_HASH }LoopStrategy;
+
 class LoopThreadPool {
     private:
         int _thread_count;
-        int _next_idx;
+        bool _auto_count;       //是否根据可用的CPU数量自动决定线程数量
+        std::string _name;      //线程名称前缀，线程名称为前缀加上下标
+        std::vector<std::vector<int>> _cpus;//每个线程绑定的CPU，第i个线程绑定_cpus[i % _cpus.size()]
+        bool _numa_local;       //线程是否从本地NUMA节点分配内存
+        uint64_t _task_budget, _task_budget_us;//每个线程每轮执行普通/批量任务的预算
+        uint64_t _busy_poll_us;     //从属线程的忙轮询时间，0表示不启用
+        int _busy_poll_sock_us;     //从属线程中连接套接字的SO_BUSY_POLL时间
+        LoopBackend _backend;       //从属线程的事件监控后端
         EventLoop *_baseloop;
         std::vector<LoopThread*> _threads;
         std::vector<EventLoop *> _loops;
+        std::vector<int> _slots;//每个线程的编号，决定线程名称以及绑定的CPU，回收的线程编号留给之后新增的线程使用
+        std::unique_ptr<LoopSelector> _selector;//新连接的分配策略
+    private:
+        //以未被使用的最小编号创建一个线程
+        void CreateThread() {
+            int slot = 0;
+            while (std::find(_slots.begin(), _slots.end(), slot) != _slots.end()) slot++;
+            std::string name = _name.empty() ? "" : _name + std::to_string(slot);
+            std::vector<int> cpus = _cpus.empty() ? std::vector<int>() : _cpus[slot % _cpus.size()];
+            LoopThread *thread = new LoopThread(name, cpus, _numa_local, _backend);
+            thread->GetLoop()->SetTaskBudget(_task_budget, _task_budget_us);
+            if (_busy_poll_us > 0) thread->GetLoop()->EnableBusyPoll(_busy_poll_us, _busy_poll_sock_us);
+            _threads.push_back(thread);
+            _loops.push_back(thread->GetLoop());
+            _slots.push_back(slot);
+        }
+        //读取cgroup的CPU配额，返回配额相当于多少个CPU（向上取整），没有限制返回0
+        static int CgroupCpuLimit() {
+            long long quota = -1, period = 0;
+            FILE *fp = fopen("/sys/fs/cgroup/cpu.max", "r");//cgroup v2: "配额 周期"，配额为max表示不限制
+            if (fp != NULL) {
+                if (fscanf(fp, "%lld %lld", &quota, &period) != 2) quota = -1;
+                fclose(fp);
+            }else {
+                fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");//cgroup v1: 配额为-1表示不限制
+                if (fp != NULL) {
+                    if (fscanf(fp, "%lld", &quota) != 1) quota = -1;
+                    fclose(fp);
+                }
+                fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+                if (fp != NULL) {
+                    if (fscanf(fp, "%lld", &period) != 1) period = 0;
+                    fclose(fp);
+                }
+            }
+            if (quota <= 0 || period <= 0) return 0;
+            return (quota + period - 1) / period;
+        }
     public:
-        LoopThreadPool(EventLoop *baseloop):_thread_count(0), _next_idx(0), _baseloop(baseloop) {}
-        void SetThreadCount(int count) { _thread_count = count; }
+        LoopThreadPool(EventLoop *baseloop):_thread_count(0), _auto_count(false), _numa_local(false),
+            _task_budget(0), _task_budget_us(0), _busy_poll_us(0), _busy_poll_sock_us(0), _backend(BACKEND_EPOLL),
+            _baseloop(baseloop), _selector(new RoundRobinSelector()) {}
+        //当前进程可以使用的CPU数量：取允许运行的CPU数量与cgroup配额中较小的一个
+        static int AvailableCpus() {
+            int count = 0;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) count = CPU_COUNT(&set);
+            if (count <= 0) count = sysconf(_SC_NPROCESSORS_ONLN);
+            int limit = CgroupCpuLimit();
+            if (limit > 0 && limit < count) count = limit;
+            return count > 0 ? count : 1;
+        }
+        void SetThreadName(const std::string &name) { _name = name; }
+        void SetThreadCpus(const std::vector<std::vector<int>> &cpus) { _cpus = cpus; }
+        void EnableNumaLocal() { _numa_local = true; }
+        //设置之后新建的线程使用这个预算，已有的线程也一起修改
+        void SetTaskBudget(uint64_t count, uint64_t us) {
+            _task_budget = count;
+            _task_budget_us = us;
+            for (auto loop : _loops) loop->SetTaskBudget(count, us);
+        }
+        //只对Create之后新建的线程生效
+        void EnableBusyPoll(uint64_t spin_us, int sock_us) { _busy_poll_us = spin_us; _busy_poll_sock_us = sock_us; }
+        //只对之后新建的线程生效
+        void SetBackend(LoopBackend backend) { _backend = backend; }
+        void SetSelector(LoopSelector *selector) { _selector.reset(selector); }
+        void SetStrategy(LoopStrategy strategy) {
+            switch (strategy) {
+                case LEAST_CONNECTIONS: return SetSelector(new LeastConnSelector());
+                case TWO_CHOICES: return SetSelector(new TwoChoicesSelector());
+                case IP_HASH: return SetSelector(new IpHashSelector());
+                default: return SetSelector(new RoundRobinSelector());
+            }
+        }
+        //count为0表示根据可用的CPU数量自动决定
+        void SetThreadCount(int count) { _thread_count = count; _auto_count = (count == 0); }
         void Create() {
-            if (_thread_count > 0) {
-                _threads.resize(_thread_count);
-                _loops.resize(_thread_count);
-                for (int i = 0; i < _thread_count; i++) {
-                    _threads[i] = new LoopThread();
-                    _loops[i] = _threads[i]->GetLoop();
-                }
+            if (_auto_count) _thread_count = AvailableCpus();
+            for (int i = 0; i < _thread_count; i++) {
+                CreateThread();
             }
             return ;
         }
-        EventLoop *NextLoop() {
+        /*以下两个接口用于运行时调整线程数量，只能在主线程中调用*/
+        //新增一个从属线程，之后的新连接就可以分配给它
+        EventLoop *AddThread() {
+            CreateThread();
+            _thread_count++;
+            return _loops.back();
+        }
+        //把loop对应的线程移出线程池，之后不再给它分配新连接；线程中已有的连接处理完之后，由调用者调用LoopThread::Stop回收
+        LoopThread *RetireThread(EventLoop *loop) {
+            auto it = std::find(_loops.begin(), _loops.end(), loop);
+            if (it == _loops.end()) return NULL;
+            size_t idx = it - _loops.begin();
+            LoopThread *thread = _threads[idx];
+            _threads.erase(_threads.begin() + idx);
+            _loops.erase(it);
+            _slots.erase(_slots.begin() + idx);
+            _thread_count--;
+            return thread;
+        }
+        int ThreadCount() { return _thread_count; }
+        EventLoop *GetLoop(int idx) { return _loops[idx]; }
+        //为描述符fd对应的新连接选择一个EventLoop
+        EventLoop *NextLoop(int fd) {
             if (_thread_count == 0) {
                 return _baseloop;
             }
-            _next_idx = (_next_idx + 1) % _thread_count;
-            return _loops[_next_idx];
+            return _selector->Select(_loops, fd);
         }
 };
 
@@ -799,72 +2435,158 @@ class Any{
         }
 };
 
+//挂起在连接上等待某个条件（数据到齐、发送完毕）的协程，连接在条件满足时恢复它
+//协程只在C++20中可用，连接只依赖这个接口，C++11编译时不会有任何等待者
+class CoWaiter {
+    public:
+        virtual ~CoWaiter() {}
+        virtual bool Ready() = 0;   //等待的条件是否已经满足（连接关闭也算满足）
+        virtual void Wake() = 0;    //恢复协程
+};
 class Connection;
 //DISCONECTED -- 连接关闭状态；   CONNECTING -- 连接建立成功-待处理状态
 //CONNECTED -- 连接建立完成，各种设置已完成，可以通信的状态；  DISCONNECTING -- 待关闭状态
 typedef enum { DISCONNECTED, CONNECTING, CONNECTED, DISCONNECTING}ConnStatu;
 using PtrConnection = std::shared_ptr<Connection>;
-class Connection : public std::enable_shared_from_this<Connection> {
+#define URING_SEND_IOV 64   //io_uring后端一次发送请求最多携带的分段数量
+class Connection : public std::enable_shared_from_this<Connection>, public UringHandler {
     private:
         uint64_t _conn_id;  // 连接的唯一ID，便于连接的管理和查找
         //uint64_t _timer_id;   //定时器ID，必须是唯一的，这块为了简化操作使用conn_id作为定时器ID
         int _sockfd;        // 连接关联的文件描述符
         bool _enable_inactive_release;  // 连接是否启动非活跃销毁的判断标志，默认为false
-        EventLoop *_loop;   // 连接所关联的一个EventLoop
+        uint64_t _read_budget;  // 一次可读事件中最多读取的字节数，避免一个连接长时间占用线程
+        bool _auto_cork;    // 是否合并一轮循环中的多次发送，统一在循环末尾发送
+        bool _cork_pending; // 是否已经在EventLoop中登记了合并发送
+        std::atomic<EventLoop *> _loop;// 连接所关联的一个EventLoop，连接迁移时会被修改，其他线程中会读取
+        int _inactive_timeout; // 非活跃销毁的超时时间，迁移时在新的EventLoop中重新添加定时任务
+        uint64_t _last_active; // 最近一次触发事件的时间（CLOCK_MONOTONIC毫秒），定时任务到期时据此判断是否真的不活跃
         ConnStatu _statu;   // 连接状态
         Socket _socket;     // 套接字操作管理
         Channel _channel;   // 连接的事件管理
         Buffer _in_buffer;  // 输入缓冲区---存放从socket中读取到的数据
-        Buffer _out_buffer; // 输出缓冲区---存放要发送给对端的数据
+        OutputQueue _out_buffer; // 输出缓冲区---存放要发送给对端的数据
         Any _context;       // 请求的接收处理上下文
+        /*io_uring后端：收发都是提交给内核的请求，请求完成之前连接对象以及发送的数据都必须有效*/
+        bool _uring;        // 所属EventLoop是否使用io_uring后端，这时不再使用_channel
+        bool _uring_sending;// 是否有还没有完成的发送请求
+        int _uring_inflight;// 还没有完成的请求数量
+        PtrConnection _uring_self;// 有请求没有完成时持有连接自身
+        struct UringSendState {
+            struct msghdr _msg;
+            struct iovec _iov[URING_SEND_IOV];
+        };
+        std::unique_ptr<UringSendState> _uring_send;// 发送请求使用的msghdr，第一次发送时才申请，避免增大空闲连接
+        CoWaiter *_co_reader;   // 等待数据的协程，有协程在等待时新数据不再交给_message_callback
+        CoWaiter *_co_writer;   // 等待发送缓冲区清空的协程
+        int _co_sleeping;       // 在Sleep中挂起的协程数量，它们只能由挂起时的EventLoop恢复
 
+    public:
         /*这四个回调函数，是让服务器模块来设置的（其实服务器模块的处理回调也是组件使用者设置的）*/
         /*换句话说，这几个回调都是组件使用者使用的*/
         using ConnectedCallback = std::function<void(const PtrConnection&)>;
         using MessageCallback = std::function<void(const PtrConnection&, Buffer *)>;
         using ClosedCallback = std::function<void(const PtrConnection&)>;
         using AnyEventCallback = std::function<void(const PtrConnection&)>;
-        ConnectedCallback _connected_callback;
-        MessageCallback _message_callback;
-        ClosedCallback _closed_callback;
-        AnyEventCallback _event_callback;
-        /*组件内的连接关闭回调--组件内设置的，因为服务器组件内会把所有的连接管理起来，一旦某个连接要关闭*/
-        /*就应该从管理的地方移除掉自己的信息*/
-        ClosedCallback _server_closed_callback;
+        /*一个服务器的所有连接使用的回调都是一样的，因此放到一起由所有连接共享，连接对象中只保存一个指针*/
+        struct Callbacks {
+            ConnectedCallback _connected_callback;
+            MessageCallback _message_callback;
+            ClosedCallback _closed_callback;
+            AnyEventCallback _event_callback;
+            /*组件内的连接关闭回调--组件内设置的，因为服务器组件内会把所有的连接管理起来，一旦某个连接要关闭*/
+            /*就应该从管理的地方移除掉自己的信息*/
+            ClosedCallback _server_closed_callback;
+        };
+        using PtrCallbacks = std::shared_ptr<Callbacks>;
     private:
+        PtrCallbacks _cbs;  // 共享的回调函数，单独修改某个连接的回调时先复制一份（写时拷贝）
+    private:
+        EventLoop *Loop() { return _loop; }
+        /*连接可能已经迁移到其他EventLoop，迁移之前投递到原EventLoop的任务，需要转交给新的EventLoop执行*/
+        bool InOwnerLoop() { return Loop()->IsInLoop(); }
+        void Redirect(TaskFunc task) { Loop()->QueueInLoop(std::move(task)); }
+        //获取可以修改的回调集合，与其他连接共享时先复制一份
+        Callbacks *MutableCallbacks() {
+            if (_cbs.use_count() > 1) _cbs = std::make_shared<Callbacks>(*_cbs);
+            return _cbs.get();
+        }
+        static PtrCallbacks EmptyCallbacks() {
+            static PtrCallbacks empty = std::make_shared<Callbacks>();
+            return empty;
+        }
+        //新数据交给等待的协程，没有协程在等待则交给_message_callback
+        void DispatchMessage() {
+            if (_co_reader != NULL) return WakeReader();
+            if (_cbs->_message_callback) _cbs->_message_callback(shared_from_this(), &_in_buffer);
+        }
+        //等待的条件满足了就恢复协程，恢复之前先清除登记，协程中可以再次等待
+        void WakeReader() {
+            if (_co_reader == NULL || !_co_reader->Ready()) return;
+            CoWaiter *waiter = _co_reader;
+            _co_reader = NULL;
+            waiter->Wake();
+        }
+        void WakeWriter() {
+            if (_co_writer == NULL || !_co_writer->Ready()) return;
+            CoWaiter *waiter = _co_writer;
+            _co_writer = NULL;
+            waiter->Wake();
+        }
         /*五个channel的事件回调函数*/
         //描述符可读事件触发后调用的函数，接收socket数据放到接收缓冲区中，然后调用_message_callback
         void HandleRead() {
-            //1. 接收socket的数据，放到缓冲区
-            char buf[65536];
-            ssize_t ret = _socket.NonBlockRecv(buf, 65535);
-            if (ret < 0) {
-                //出错了,不能直接关闭连接
+            //1. 接收socket的数据，直接读到输入缓冲区中，一直读到EAGAIN或者达到本次读取的字节上限
+            uint64_t total = 0;
+            while (total < _read_budget) {
+                int err = 0;
+                ssize_t ret = _in_buffer.ReadFromFd(_sockfd, &err);
+                if (ret > 0) {
+                    total += ret;
+                    continue;
+                }
+                if (ret < 0 && err == EINTR) continue;
+                //EAGAIN表示内核接收缓冲区已经读空了
+                if (ret < 0 && (err == EAGAIN || err == EWOULDBLOCK)) break;
+                //返回0表示对端关闭了连接，其他情况则是出错了,不能直接关闭连接
+                if (ret < 0) ERR_LOG("SOCKET READ FAILED!!");
                 return ShutdownInLoop();
             }
-            //这里的等于0表示的是没有读取到数据，而并不是连接断开了，连接断开返回的是-1
-            //将数据放入输入缓冲区,写入之后顺便将写偏移向后移动
-            _in_buffer.WriteAndPush(buf, ret);
+            //边缘触发模式下没有读到EAGAIN就不会再有新的可读事件，因此把剩下的读取放到任务池中稍后继续
+            if (total >= _read_budget && _channel.EdgeTriggered()) {
+                Loop()->QueueInLoop(std::bind(&Connection::ContinueReadInLoop, shared_from_this()));
+            }
             //2. 调用message_callback进行业务处理
             if (_in_buffer.ReadAbleSize() > 0) {
-                //shared_from_this--从当前对象自身获取自身的shared_ptr管理对象
-                return _message_callback(shared_from_this(), &_in_buffer);
+                DispatchMessage();
+                //大数据接收完之后如果只剩下少量半包数据，就收缩缓冲区（数据读完的话空间已经还给内存块池了）
+                _in_buffer.ShrinkToFit();
             }
         }
         //描述符可写事件触发后调用的函数，将发送缓冲区中的数据进行发送
         void HandleWrite() {
-            //_out_buffer中保存的数据就是要发送的数据
-            ssize_t ret = _socket.NonBlockSend(_out_buffer.ReadPosition(), _out_buffer.ReadAbleSize());
-            if (ret < 0) {
-                //发送错误就该关闭连接了，
-                if (_in_buffer.ReadAbleSize() > 0) {
-                    _message_callback(shared_from_this(), &_in_buffer);
+            //_out_buffer中保存的数据就是要发送的数据，把所有分段通过一次writev发送出去
+            //边缘触发模式下要一直发送到EAGAIN或者数据发完为止，否则不会再有新的可写事件
+            while (_out_buffer.ReadAbleSize() > 0) {
+                struct iovec iov[IOV_MAX];
+                int cnt = _out_buffer.PeekIov(iov, IOV_MAX);
+                ssize_t ret = _socket.NonBlockSendV(iov, cnt);
+                if (ret < 0) {
+                    //发送错误就该关闭连接了，
+                    if (_in_buffer.ReadAbleSize() > 0) {
+                        DispatchMessage();
+                    }
+                    return Release();//这时候就是实际的关闭释放操作了。
                 }
-                return Release();//这时候就是实际的关闭释放操作了。
+                if (ret == 0) break;//发送缓冲区满了
+                _out_buffer.MoveReadOffset(ret);//千万不要忘了，将读偏移向后移动
+                if (_channel.EdgeTriggered() == false) break;
             }
-            _out_buffer.MoveReadOffset(ret);//千万不要忘了，将读偏移向后移动
             if (_out_buffer.ReadAbleSize() == 0) {
-                _channel.DisableWrite();// 没有数据待发送了，关闭写事件监控
+                _out_buffer.ShrinkToFit();// 数据发送完毕，释放发送队列占用的空间
+                // 没有数据待发送了，关闭写事件监控（边缘触发模式下一直保持监控）
+                if (_channel.EdgeTriggered() == false) _channel.DisableWrite();
+                WakeWriter();
                 //如果当前是连接待关闭状态，则有数据，发送完数据释放连接，没有数据则直接释放
                 if (_statu == DISCONNECTING) {
                     return Release();
@@ -876,7 +2598,7 @@ class Connection : public std::enable_shared_from_this<Connection> {
         void HandleClose() {
             /*一旦连接挂断了，套接字就什么都干不了了，因此有数据待处理就处理一下，完毕关闭连接*/
             if (_in_buffer.ReadAbleSize() > 0) {
-                _message_callback(shared_from_this(), &_in_buffer);
+                DispatchMessage();
             }
             return Release();
         }
@@ -884,74 +2606,234 @@ class Connection : public std::enable_shared_from_this<Connection> {
         void HandleError() {
             return HandleClose();
         }
-        //描述符触发任意事件: 1. 刷新连接的活跃度--延迟定时销毁任务；  2. 调用组件使用者的任意事件回调
+        //描述符触发任意事件: 1. 记录连接的活跃时间，定时销毁任务到期时再检查；  2. 调用组件使用者的任意事件回调
         void HandleEvent() {
-            if (_enable_inactive_release == true)  {  _loop->TimerRefresh(_conn_id); }
-            if (_event_callback)  {  _event_callback(shared_from_this()); }
+            if (_enable_inactive_release == true)  {  _last_active = Loop()->LoopMs(); }
+            if (_cbs->_event_callback)  {  _cbs->_event_callback(shared_from_this()); }
+        }
+        /*io_uring后端的收发*/
+        void UringSubmitted() {
+            if (_uring_inflight++ == 0) _uring_self = shared_from_this();
+        }
+        void UringRecv() {
+            UringSubmitted();
+            Loop()->Uring()->RecvMultishot(_sockfd, this);
+        }
+        //发送缓冲区中的数据通过一个SENDMSG请求发送，同一时间只有一个发送请求，完成之后再发送剩下的数据
+        void UringSend() {
+            if (_uring_sending || _out_buffer.ReadAbleSize() == 0) return;
+            if (!_uring_send) _uring_send.reset(new UringSendState);
+            memset(&_uring_send->_msg, 0, sizeof(_uring_send->_msg));
+            _uring_send->_msg.msg_iov = _uring_send->_iov;
+            _uring_send->_msg.msg_iovlen = _out_buffer.PeekIov(_uring_send->_iov, URING_SEND_IOV);
+            _uring_sending = true;
+            UringSubmitted();
+            Loop()->Uring()->SendMsg(_sockfd, &_uring_send->_msg, this);
+        }
+        virtual void OnComplete(UringOp op, int res, uint32_t flags) {
+            PtrConnection self = shared_from_this();//请求全部完成之后_uring_self被释放，处理完之前连接不能被销毁
+            if (!(flags & IORING_CQE_F_MORE) && --_uring_inflight == 0) _uring_self.reset();
+            if (op == URING_OP_RECV) return UringRecvDone(res, flags);
+            if (op == URING_OP_SEND) return UringSendDone(res);
+        }
+        void UringRecvDone(int res, uint32_t flags) {
+            UringPoller *uring = Loop()->Uring();
+            if (flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if (res > 0 && _statu != DISCONNECTED) _in_buffer.WriteAndPush(uring->Buffer(bid), res);
+                uring->ReturnBuffer(bid);
+            }
+            if (_statu == DISCONNECTED) return;
+            //返回0表示对端关闭了连接，其他情况则是出错了（接收缓冲区用完除外）
+            if (res == 0) return ShutdownInLoop();
+            if (res < 0 && res != -ENOBUFS) {
+                ERR_LOG("SOCKET READ FAILED!!");
+                return ShutdownInLoop();
+            }
+            //接收缓冲区用完或者内核结束了这次multishot，重新提交
+            if (!(flags & IORING_CQE_F_MORE)) UringRecv();
+            if (_in_buffer.ReadAbleSize() > 0) {
+                DispatchMessage();
+                _in_buffer.ShrinkToFit();
+            }
+            HandleEvent();
+        }
+        void UringSendDone(int res) {
+            _uring_sending = false;
+            //释放时发送请求还没有完成，发送缓冲区推迟到这里清理
+            if (_statu == DISCONNECTED) return _out_buffer.Clear();
+            if (res < 0) {
+                if (_in_buffer.ReadAbleSize() > 0) {
+                    DispatchMessage();
+                }
+                return Release();
+            }
+            _out_buffer.MoveReadOffset(res);
+            if (_out_buffer.ReadAbleSize() > 0) {
+                UringSend();
+            }else {
+                _out_buffer.ShrinkToFit();
+                WakeWriter();
+                if (_statu == DISCONNECTING) return Release();
+            }
+            HandleEvent();
         }
         //连接获取之后，所处的状态下要进行各种设置（启动读监控,调用回调函数）
         void EstablishedInLoop() {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::EstablishedInLoop, shared_from_this()));
             // 1. 修改连接状态；  2. 启动读事件监控；  3. 调用回调函数
             assert(_statu == CONNECTING);//当前的状态必须一定是上层的半连接状态
             _statu = CONNECTED;//当前函数执行完毕，则连接进入已完成连接状态
+            if (Loop()->BusyPollSocketUs() > 0) _socket.BusyPoll(Loop()->BusyPollSocketUs());
             // 一旦启动读事件监控就有可能会立即触发读事件，如果这时候启动了非活跃连接销毁
-            _channel.EnableRead();
-            if (_connected_callback) _connected_callback(shared_from_this());
+            if (_uring) UringRecv();
+            else _channel.EnableRead();
+            if (_cbs->_connected_callback) _cbs->_connected_callback(shared_from_this());
         }
         //这个接口才是实际的释放接口
         void ReleaseInLoop() {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::ReleaseInLoop, shared_from_this()));
+            //可能因为多种事件多次进入释放流程，只释放一次
+            if (_statu == DISCONNECTED) return;
             //1. 修改连接状态，将其置为DISCONNECTED
             _statu = DISCONNECTED;
-            //2. 移除连接的事件监控
+            Loop()->AddConnCount(-1);
+            //2. 移除连接的事件监控，io_uring后端下取消还没有完成的收发请求
             _channel.Remove();
+            if (_uring && _uring_inflight > 0) {
+                Loop()->Uring()->Cancel(this, URING_OP_RECV);
+                if (_uring_sending) Loop()->Uring()->Cancel(this, URING_OP_SEND);
+            }
             //3. 关闭描述符
             _socket.Close();
+            //   把缓冲区的内存块还给EventLoop的内存块池，连接对象最终可能在其他线程中析构，因此必须在这里归还
+            //   内核可能还在读取发送请求中的数据，这时等发送请求完成之后再归还
+            _in_buffer.Clear();
+            if (!_uring_sending) _out_buffer.Clear();
             //4. 如果当前定时器队列中还有定时销毁任务，则取消任务
-            if (_loop->HasTimer(_conn_id)) CancelInactiveReleaseInLoop();
+            if (Loop()->HasTimer(_conn_id)) CancelInactiveReleaseInLoop();
+            //   挂起在这个连接上的协程都恢复执行，读取/发送返回失败
+            WakeReader();
+            WakeWriter();
             //5. 调用关闭回调函数，避免先移除服务器管理的连接信息导致Connection被释放，再去处理会出错，因此先调用用户的回调函数
-            if (_closed_callback) _closed_callback(shared_from_this());
+            if (_cbs->_closed_callback) _cbs->_closed_callback(shared_from_this());
             //移除服务器内部管理的连接信息
-            if (_server_closed_callback) _server_closed_callback(shared_from_this());
+            if (_cbs->_server_closed_callback) _cbs->_server_closed_callback(shared_from_this());
         }
-        //这个接口并不是实际的发送接口，而只是把数据放到了发送缓冲区，启动了可写事件监控
-        void SendInLoop(Buffer &buf) {
+        //发送缓冲区为空时先直接尝试发送，返回已发送的字节数，出错返回-1
+        ssize_t TrySendDirect(const char *data, uint64_t len) {
+            if (_out_buffer.ReadAbleSize() > 0) return 0;
+            return _socket.NonBlockSend((void*)data, len);
+        }
+        //这个接口并不是实际的发送接口，发送不完的数据才放到发送缓冲区，启动可写事件监控
+        void SendInLoop(const char *data, uint64_t len) {
             if (_statu == DISCONNECTED) return ;
-            _out_buffer.WriteBufferAndPush(buf);
+            //io_uring后端下总是合并到本轮循环末尾，通过一个发送请求发送
+            if (_auto_cork || _uring) {
+                _out_buffer.Write(data, len);
+                return CorkInLoop();
+            }
+            ssize_t ret = TrySendDirect(data, len);
+            if (ret < 0) return Release();
+            if ((uint64_t)ret == len) return ;
+            _out_buffer.Write(data + ret, len - ret);
+            //边缘触发模式下直接发送时已经遇到EAGAIN，等待下一次可写事件即可
             if (_channel.WriteAble() == false) {
                 _channel.EnableWrite();
             }
         }
+        //与SendInLoop相同，只不过剩余数据不再拷贝，而是由holder持有，直接挂到发送缓冲区中
+        void SendSliceInLoop(const std::shared_ptr<const void> &holder, const char *data, uint64_t len) {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::SendSliceInLoop, shared_from_this(), holder, data, len));
+            if (_statu == DISCONNECTED) return ;
+            if (_auto_cork || _uring) {
+                _out_buffer.WriteSlice(data, len, holder);
+                return CorkInLoop();
+            }
+            ssize_t ret = TrySendDirect(data, len);
+            if (ret < 0) return Release();
+            if ((uint64_t)ret == len) return ;
+            _out_buffer.WriteSlice(data + ret, len - ret, holder);
+            if (_channel.WriteAble() == false) {
+                _channel.EnableWrite();
+            }
+        }
+        //合并发送模式下只把数据放入发送缓冲区，每轮循环只登记一次统一发送
+        void CorkInLoop() {
+            if (_cork_pending) return;
+            _cork_pending = true;
+            Loop()->QueueCork(std::bind(&Connection::FlushCorkInLoop, shared_from_this()));
+        }
+        //把本轮循环中积攒的数据通过一次writev发送出去，发送不完的再启动可写事件监控
+        void FlushCorkInLoop() {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::FlushCorkInLoop, shared_from_this()));
+            _cork_pending = false;
+            if (_statu == DISCONNECTED || _out_buffer.ReadAbleSize() == 0) return;
+            if (_uring) return UringSend();
+            //水平触发模式下已经在等待可写事件，交给HandleWrite处理即可
+            if (_channel.EdgeTriggered() == false && _channel.WriteAble()) return;
+            HandleWrite();
+            if (_statu != DISCONNECTED && _out_buffer.ReadAbleSize() > 0 && _channel.WriteAble() == false) {
+                _channel.EnableWrite();
+            }
+        }
         //这个关闭操作并非实际的连接释放操作，需要判断还有没有数据待处理，待发送
         void ShutdownInLoop() {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::ShutdownInLoop, shared_from_this()));
+            if (_statu == DISCONNECTED) return;
             _statu = DISCONNECTING;// 设置连接为半关闭状态
             if (_in_buffer.ReadAbleSize() > 0) {
-                if (_message_callback) _message_callback(shared_from_this(), &_in_buffer);
+                DispatchMessage();
             }
             //要么就是写入数据的时候出错关闭，要么就是没有待发送数据，直接关闭
+            //io_uring后端下数据发送完之后由UringSendDone释放
+            if (_uring && _out_buffer.ReadAbleSize() > 0) return UringSend();
             if (_out_buffer.ReadAbleSize() > 0) {
                 if (_channel.WriteAble() == false) {
                     _channel.EnableWrite();
                 }
+                //边缘触发模式下可写事件不一定会再次触发，先主动发送一次
+                if (_channel.EdgeTriggered()) return HandleWrite();
             }
             if (_out_buffer.ReadAbleSize() == 0) {
                 Release();
             }
         }
+        //边缘触发模式下，上一次可读事件因为达到读取上限而没有读完的数据，在这里继续读取
+        void ContinueReadInLoop() {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::ContinueReadInLoop, shared_from_this()));
+            if (_statu == DISCONNECTED) return;
+            HandleRead();
+        }
         //启动非活跃连接超时释放规则
         void EnableInactiveReleaseInLoop(int sec) {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::EnableInactiveReleaseInLoop, shared_from_this(), sec));
             //1. 将判断标志 _enable_inactive_release 置为true
             _enable_inactive_release = true;
-            //2. 如果当前定时销毁任务已经存在，那就刷新延迟一下即可
-            if (_loop->HasTimer(_conn_id)) {
-                return _loop->TimerRefresh(_conn_id);
+            _inactive_timeout = sec;
+            _last_active = Loop()->LoopMs();
+            //2. 如果当前定时销毁任务已经存在，超时时间可能改变了，取消之后重新添加
+            if (Loop()->HasTimer(_conn_id)) {
+                Loop()->TimerCancel(_conn_id);
+            }
+            //3. 新增定时销毁任务
+            Loop()->TimerAdd(_conn_id, (uint64_t)sec * 1000, std::bind(&Connection::HandleInactiveTimeout, this));
+        }
+        //定时销毁任务到期：这段时间内有过活动，就按照最后一次活动的时间重新添加，否则释放连接
+        //事件处理时只记录时间，每个超时周期最多重新添加一次定时任务
+        void HandleInactiveTimeout() {
+            uint64_t deadline = _last_active + (uint64_t)_inactive_timeout * 1000;
+            uint64_t now = Loop()->LoopMs();
+            if (deadline > now) {
+                return Loop()->TimerAdd(_conn_id, deadline - now, std::bind(&Connection::HandleInactiveTimeout, this));
             }
-            //3. 如果不存在定时销毁任务，则新增
-            _loop->TimerAdd(_conn_id, sec, std::bind(&Connection::Release, this));
+            Release();
         }
         void CancelInactiveReleaseInLoop() {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::CancelInactiveReleaseInLoop, shared_from_this()));
             _enable_inactive_release = false;
-            if (_loop->HasTimer(_conn_id)) { 
-                _loop->TimerCancel(_conn_id); 
+            if (Loop()->HasTimer(_conn_id)) { 
+                Loop()->TimerCancel(_conn_id); 
             }
         }
         void UpgradeInLoop(const Any &context, 
@@ -959,93 +2841,326 @@ class Connection : public std::enable_shared_from_this<Connection> {
                     const MessageCallback &msg, 
                     const ClosedCallback &closed, 
                     const AnyEventCallback &event) {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::UpgradeInLoop, shared_from_this(), context, conn, msg, closed, event));
             _context = context;
-            _connected_callback = conn;
-            _message_callback = msg;
-            _closed_callback = closed;
-            _event_callback = event;
+            Callbacks *cbs = MutableCallbacks();
+            cbs->_connected_callback = conn;
+            cbs->_message_callback = msg;
+            cbs->_closed_callback = closed;
+            cbs->_event_callback = event;
+        }
+        //迁移到其他EventLoop，在原EventLoop的任务阶段执行，这时本轮的就绪事件已经全部处理完毕
+        void MigrateInLoop(EventLoop *loop) {
+            if (!InOwnerLoop()) return Redirect(std::bind(&Connection::MigrateInLoop, shared_from_this(), loop));
+            //只迁移正常通信中的连接；io_uring的请求属于提交它的EventLoop，无法转交，这时不迁移
+            //有协程在Sleep中挂起时也不迁移，否则原EventLoop的定时器会在新EventLoop处理连接的同时恢复协程
+            if (_statu != CONNECTED || loop == Loop() || _uring || loop->Uring() != NULL || _co_sleeping > 0) return;
+            //1. 本轮合并的待发送数据先发送出去
+            if (_cork_pending) FlushCorkInLoop();
+            //2. 取消原EventLoop中的非活跃销毁定时任务，移除原EventLoop中的事件监控
+            bool inactive = _enable_inactive_release;
+            if (inactive) CancelInactiveReleaseInLoop();
+            _channel.Remove();
+            //3. 缓冲区中的数据保留，内存块之后归还给新EventLoop的内存块池
+            _in_buffer.ChangePool(loop->GetBlockPool());
+            _out_buffer.ChangePool(loop->GetBlockPool());
+            Loop()->AddConnCount(-1);
+            loop->AddConnCount(1);
+            loop->AddConnRef(1);
+            Loop()->AddConnRef(-1);
+            //4. 修改所属的EventLoop，之后投递到原EventLoop的任务都会被转交过去
+            _channel.SetLoop(loop);
+            _loop = loop;
+            loop->RunInLoop(std::bind(&Connection::MigratedInLoop, shared_from_this(), inactive), TASK_URGENT);
+        }
+        //在新的EventLoop中重新添加事件监控以及非活跃销毁定时任务
+        void MigratedInLoop(bool inactive) {
+            if (_statu == DISCONNECTED) return;
+            if (Loop()->BusyPollSocketUs() > 0) _socket.BusyPoll(Loop()->BusyPollSocketUs());
+            //水平触发模式下添加监控后未处理的数据会继续就绪；边缘触发模式下添加监控时也会上报当前已就绪的事件
+            _channel.Update();
+            if (inactive) EnableInactiveReleaseInLoop(_inactive_timeout);
         }
     public:
         Connection(EventLoop *loop, uint64_t conn_id, int sockfd):_conn_id(conn_id), _sockfd(sockfd),
-            _enable_inactive_release(false), _loop(loop), _statu(CONNECTING), _socket(_sockfd),
-            _channel(loop, _sockfd) {
-            _channel.SetCloseCallback(std::bind(&Connection::HandleClose, this));
-            _channel.SetEventCallback(std::bind(&Connection::HandleEvent, this));
-            _channel.SetReadCallback(std::bind(&Connection::HandleRead, this));
-            _channel.SetWriteCallback(std::bind(&Connection::HandleWrite, this));
-            _channel.SetErrorCallback(std::bind(&Connection::HandleError, this));
-        }
-        ~Connection() { DBG_LOG("RELEASE CONNECTION:%p", this); }
+            _enable_inactive_release(false), _read_budget(READ_BUDGET_DEFAULT), 
+            _auto_cork(false), _cork_pending(false), _loop(loop), _inactive_timeout(0), 
+            _last_active(0), _statu(CONNECTING), _socket(_sockfd), _channel(loop, _sockfd), 
+            _in_buffer(loop->GetBlockPool()), _out_buffer(loop->GetBlockPool()), 
+            _uring(loop->Uring() != NULL), _uring_sending(false), _uring_inflight(0), 
+            _co_reader(NULL), _co_writer(NULL), _co_sleeping(0), _cbs(EmptyCallbacks()) {
+            Loop()->AddConnCount(1);
+            Loop()->AddConnRef(1);
+            _socket.NonBlock();//读事件中会一直读到EAGAIN，因此描述符必须是非阻塞的
+            _socket.NoDelay();//SendInLoop会直接发送，不关闭Nagle的话紧接着发送的小段要等一个延迟确认（约40ms）
+            //只捕获this的lambda可以直接存放在std::function内部，不需要像std::bind成员函数那样额外申请堆空间
+            _channel.SetCloseCallback([this]() { HandleClose(); });
+            _channel.SetEventCallback([this]() { HandleEvent(); });
+            _channel.SetReadCallback([this]() { HandleRead(); });
+            _channel.SetWriteCallback([this]() { HandleWrite(); });
+            _channel.SetErrorCallback([this]() { HandleError(); });
+        }
+        //成员的析构都不会再访问EventLoop，引用计数减为0之后所属的EventLoop可能马上就会被回收
+        ~Connection() { DBG_LOG("RELEASE CONNECTION:%p", this); Loop()->AddConnRef(-1); }
         //获取管理的文件描述符
         int Fd() { return _sockfd; }
         //获取连接ID
         int Id() { return _conn_id; }
+        //获取连接当前所属的EventLoop
+        EventLoop *GetLoop() { return _loop; }
         //是否处于CONNECTED状态
         bool Connected() { return (_statu == CONNECTED); }
         //设置上下文--连接建立完成时进行调用
         void SetContext(const Any &context) { _context = context; }
         //获取上下文，返回的是指针
         Any *GetContext() { return &_context; }
-        void SetConnectedCallback(const ConnectedCallback&cb) { _connected_callback = cb; }
-        void SetMessageCallback(const MessageCallback&cb) { _message_callback = cb; }
-        void SetClosedCallback(const ClosedCallback&cb) { _closed_callback = cb; }
-        void SetAnyEventCallback(const AnyEventCallback&cb) { _event_callback = cb; }
-        void SetSrvClosedCallback(const ClosedCallback&cb) { _server_closed_callback = cb; }
+        void SetConnectedCallback(const ConnectedCallback&cb) { MutableCallbacks()->_connected_callback = cb; }
+        void SetMessageCallback(const MessageCallback&cb) { MutableCallbacks()->_message_callback = cb; }
+        void SetClosedCallback(const ClosedCallback&cb) { MutableCallbacks()->_closed_callback = cb; }
+        void SetAnyEventCallback(const AnyEventCallback&cb) { MutableCallbacks()->_event_callback = cb; }
+        void SetSrvClosedCallback(const ClosedCallback&cb) { MutableCallbacks()->_server_closed_callback = cb; }
+        //一次性设置所有回调，与其他连接共享同一份
+        void SetCallbacks(const PtrCallbacks &cbs) { _cbs = cbs; }
+        //设置一次可读事件中最多读取的字节数
+        void SetReadBudget(uint64_t budget) { _read_budget = budget; }
+        //使用边缘触发模式进行事件监控，必须在Established之前设置
+        void EnableEdgeTrigger() { assert(_statu == CONNECTING); _channel.EnableEdgeTrigger(); }
+        //合并一轮循环中的多次发送，在循环末尾通过一次writev发送，必须在Established之前设置
+        void EnableAutoCork() { assert(_statu == CONNECTING); _auto_cork = true; }
         //连接建立就绪后，进行channel回调设置，启动读监控，调用_connected_callback
         void Established() {
-            _loop->RunInLoop(std::bind(&Connection::EstablishedInLoop, this));
+            Loop()->RunInLoop(std::bind(&Connection::EstablishedInLoop, this));
         }
         //发送数据，将数据放到发送缓冲区，启动写事件监控
         void Send(const char *data, size_t len) {
+            //在EventLoop线程中则直接拷贝到发送缓冲区
+            if (Loop()->IsInLoop()) return SendInLoop(data, len);
             //外界传入的data，可能是个临时的空间，我们现在只是把发送操作压入了任务池，有可能并没有被立即执行
-            //因此有可能执行的时候，data指向的空间有可能已经被释放了。
-            Buffer buf;
-            buf.WriteAndPush(data, len);
-            _loop->RunInLoop(std::bind(&Connection::SendInLoop, this, std::move(buf)));
+            //因此有可能执行的时候，data指向的空间有可能已经被释放了, 所以拷贝一份交给任务持有。
+            return Send(std::string(data, len));
+        }
+        //以下几个发送接口会接管数据的所有权，数据从调用者一直到发送缓冲区都不再拷贝
+        void Send(std::string &&data) {
+            //数据量很小的时候，拷贝的代价比额外分配一个持有者还要低
+            if (data.size() < OUTPUT_SLICE_MIN && Loop()->IsInLoop()) return SendInLoop(data.data(), data.size());
+            std::shared_ptr<const std::string> holder = std::make_shared<std::string>(std::move(data));
+            return Send(holder);
+        }
+        void Send(Buffer &&buf) {
+            if (buf.ReadAbleSize() < OUTPUT_SLICE_MIN && Loop()->IsInLoop()) return SendInLoop(buf.ReadPosition(), buf.ReadAbleSize());
+            //移动只转移缓冲区空间的所有权，数据的位置不变，从holder中取可读数据的位置即可
+            std::shared_ptr<Buffer> holder = std::make_shared<Buffer>(std::move(buf));
+            Loop()->RunInLoop(std::bind(&Connection::SendSliceInLoop, this, 
+                std::shared_ptr<const void>(holder), holder->ReadPosition(), holder->ReadAbleSize()));
+        }
+        //共享的数据（例如多个连接广播同一份数据），只增加引用计数
+        void Send(std::shared_ptr<const std::string> data) {
+            const char *ptr = data->data();
+            uint64_t len = data->size();
+            Loop()->RunInLoop(std::bind(&Connection::SendSliceInLoop, this, 
+                std::shared_ptr<const void>(std::move(data)), ptr, len));
         }
         //提供给组件使用者的关闭接口--并不实际关闭，需要判断有没有数据待处理
         void Shutdown() {
-            _loop->RunInLoop(std::bind(&Connection::ShutdownInLoop, this));
+            Loop()->RunInLoop(std::bind(&Connection::ShutdownInLoop, this));
         }
         void Release() {
-            _loop->QueueInLoop(std::bind(&Connection::ReleaseInLoop, this));
+            //释放可能被多个事件重复触发，任务中持有连接的shared_ptr，避免第一次释放之后连接对象已经被销毁
+            //释放操作代价很小，并且能尽早归还资源，不受任务预算限制
+            Loop()->QueueInLoop(std::bind(&Connection::ReleaseInLoop, shared_from_this()), TASK_URGENT);
         }
         //启动非活跃销毁，并定义多长时间无通信就是非活跃，添加定时任务
         void EnableInactiveRelease(int sec) {
-            _loop->RunInLoop(std::bind(&Connection::EnableInactiveReleaseInLoop, this, sec));
+            Loop()->RunInLoop(std::bind(&Connection::EnableInactiveReleaseInLoop, this, sec));
         }
         //取消非活跃销毁
         void CancelInactiveRelease() {
-            _loop->RunInLoop(std::bind(&Connection::CancelInactiveReleaseInLoop, this));
+            Loop()->RunInLoop(std::bind(&Connection::CancelInactiveReleaseInLoop, this));
+        }
+        //把连接迁移到另一个EventLoop，事件监控、非活跃销毁定时任务以及缓冲区中的数据一起迁移，可以在任意线程中调用
+        //迁移总是放到任务池中执行，避免连接的事件在原EventLoop本轮的就绪事件处理中还没有被处理
+        void MigrateTo(EventLoop *loop) {
+            Loop()->QueueInLoop(std::bind(&Connection::MigrateInLoop, shared_from_this(), loop));
         }
         //切换协议---重置上下文以及阶段性回调处理函数 -- 而是这个接口必须在EventLoop线程中立即执行
         //防备新的事件触发后，处理的时候，切换任务还没有被执行--会导致数据使用原协议处理了。
         void Upgrade(const Any &context, const ConnectedCallback &conn, const MessageCallback &msg, 
                      const ClosedCallback &closed, const AnyEventCallback &event) {
-            _loop->AssertInLoop();
-            _loop->RunInLoop(std::bind(&Connection::UpgradeInLoop, this, context, conn, msg, closed, event));
+            Loop()->AssertInLoop();
+            Loop()->RunInLoop(std::bind(&Connection::UpgradeInLoop, this, context, conn, msg, closed, event));
+        }
+#if defined(__cpp_impl_coroutine)
+        /*协程接口：只能在连接所属的EventLoop线程中（也就是连接的处理协程中）调用，同一时间只能有一个协程在读、一个协程在写*/
+        class ReadAwaiter;
+        class WriteAwaiter;
+        class SleepAwaiter;
+        //co_await读取到delim为止的数据（包括delim），连接关闭返回空字符串
+        ReadAwaiter ReadUntil(const std::string &delim);
+        //co_await读取len字节的数据，连接关闭返回空字符串
+        ReadAwaiter ReadExactly(uint64_t len);
+        //co_await发送数据，数据全部交给内核之后返回true，连接关闭返回false；data在co_await结束之前必须有效
+        WriteAwaiter Write(const std::string &data);
+        WriteAwaiter Write(const char *data, size_t len);
+        //co_await等待ms毫秒，与EventLoop::Sleep相同；连接的处理协程应该使用这个接口，挂起期间连接不会被迁移
+        SleepAwaiter Sleep(uint64_t ms);
+#endif
+};
+
+#if defined(__cpp_impl_coroutine)
+class Connection::ReadAwaiter : public CoWaiter {
+    private:
+        PtrConnection _conn;
+        std::string _delim; //为空表示按照长度读取
+        uint64_t _len;      //要读取的长度，按分隔符读取时找到分隔符之后才确定
+        uint64_t _scanned;  //已经查找过分隔符的数据长度，新数据到来时不再从头查找
+        std::coroutine_handle<> _handle;
+    public:
+        ReadAwaiter(const PtrConnection &conn, const std::string &delim, uint64_t len):
+            _conn(conn), _delim(delim), _len(len), _scanned(0) {}
+        virtual bool Ready() {
+            if (_conn->_statu == DISCONNECTED) return true;
+            Buffer &buf = _conn->_in_buffer;
+            if (_delim.empty()) return buf.ReadAbleSize() >= _len;
+            const char *begin = buf.ReadPosition(), *end = begin + buf.ReadAbleSize();
+            uint64_t from = _scanned >= _delim.size() ? _scanned - _delim.size() + 1 : 0;
+            const char *pos = std::search(begin + from, end, _delim.begin(), _delim.end());
+            if (pos == end) {
+                _scanned = end - begin;
+                return false;
+            }
+            _len = pos - begin + _delim.size();
+            _delim.clear();
+            return true;
+        }
+        virtual void Wake() { _handle.resume(); }
+        bool await_ready() {
+            _conn->Loop()->AssertInLoop();
+            return Ready();
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            assert(_conn->_co_reader == NULL);
+            _handle = handle;
+            _conn->_co_reader = this;
         }
+        std::string await_resume() {
+            if (_conn->_statu == DISCONNECTED || !_delim.empty()) return std::string();
+            return _conn->_in_buffer.ReadAsStringAndPop(_len);
+        }
+};
+class Connection::WriteAwaiter : public CoWaiter {
+    private:
+        PtrConnection _conn;
+        const char *_data;
+        size_t _len;
+        std::coroutine_handle<> _handle;
+    public:
+        WriteAwaiter(const PtrConnection &conn, const char *data, size_t len):_conn(conn), _data(data), _len(len) {}
+        virtual bool Ready() { return _conn->_statu == DISCONNECTED || _conn->_out_buffer.ReadAbleSize() == 0; }
+        virtual void Wake() { _handle.resume(); }
+        //能直接发送完就不挂起；合并发送模式以及io_uring后端下数据在本轮循环末尾发送，发送完毕之后恢复
+        bool await_ready() {
+            _conn->Loop()->AssertInLoop();
+            _conn->SendInLoop(_data, _len);
+            return Ready();
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            assert(_conn->_co_writer == NULL);
+            _handle = handle;
+            _conn->_co_writer = this;
+        }
+        bool await_resume() { return _conn->_statu != DISCONNECTED; }
+};
+inline Connection::ReadAwaiter Connection::ReadUntil(const std::string &delim) {
+    assert(!delim.empty());
+    return ReadAwaiter(shared_from_this(), delim, 0);
+}
+inline Connection::ReadAwaiter Connection::ReadExactly(uint64_t len) { return ReadAwaiter(shared_from_this(), "", len); }
+inline Connection::WriteAwaiter Connection::Write(const std::string &data) { return Write(data.data(), data.size()); }
+inline Connection::WriteAwaiter Connection::Write(const char *data, size_t len) { return WriteAwaiter(shared_from_this(), data, len); }
+class Connection::SleepAwaiter {
+    private:
+        PtrConnection _conn;
+        uint64_t _ms;
+    public:
+        SleepAwaiter(const PtrConnection &conn, uint64_t ms):_conn(conn), _ms(ms) {}
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            _conn->Loop()->AssertInLoop();
+            _conn->_co_sleeping++;
+            PtrConnection conn = _conn;
+            auto wake = [conn, handle]() { conn->_co_sleeping--; handle.resume(); };
+            if (_ms == 0) return _conn->Loop()->QueueInLoop(wake);
+            _conn->Loop()->RunAfter(_ms, wake);
+        }
+        void await_resume() {}
 };
+inline Connection::SleepAwaiter Connection::Sleep(uint64_t ms) { return SleepAwaiter(shared_from_this(), ms); }
+#endif
 
-class Acceptor {
+class Acceptor : public UringHandler {
     private:
         Socket _socket;//用于创建监听套接字
         EventLoop *_loop; //用于对监听套接字进行事件监控
         Channel _channel; //用于对监听套接字进行事件管理
+        int _idle_fd;     //预留的空闲描述符，描述符耗尽时用它来接受并关闭新连接
+        int _accept_budget;//一次可读事件中最多获取的新连接数量
+        std::vector<int> _newfds;//一次可读事件中获取到的新连接，循环复用
+        bool _uring_accepting;   //io_uring后端下是否提交了multishot accept请求
 
-        using AcceptCallback = std::function<void(int)>;
+        using AcceptCallback = std::function<void(const std::vector<int>&)>;
         AcceptCallback _accept_callback;
     private:
-        /*监听套接字的读事件回调处理函数---获取新连接，调用_accept_callback函数进行新连接处理*/
+        /*监听套接字的读事件回调处理函数---一直获取新连接直到EAGAIN或者达到上限，调用_accept_callback批量处理新连接*/
         void HandleRead() {
-            int newfd = _socket.Accept();
-            if (newfd < 0) {
-                return ;
+            while ((int)_newfds.size() < _accept_budget) {
+                int err = 0;
+                int newfd = _socket.NonBlockAccept(&err);
+                if (newfd >= 0) {
+                    _newfds.push_back(newfd);
+                    continue;
+                }
+                if (err == EINTR || err == ECONNABORTED) continue;
+                if (err == EMFILE || err == ENFILE) {
+                    //描述符耗尽，新连接一直留在全连接队列中会导致水平触发的监听套接字不停就绪，
+                    //先释放预留的描述符把连接接受下来再关闭，然后重新预留
+                    ERR_LOG("SOCKET ACCEPT FAILED: TOO MANY OPEN FILES!");
+                    ReleaseOverflow();
+                }
+                else if (err != EAGAIN) {
+                    ERR_LOG("SOCKET ACCEPT FAILED!");
+                }
+                break;
+            }
+            FlushAccepted();
+        }
+        //把获取到的新连接交给_accept_callback批量处理
+        void FlushAccepted() {
+            if (!_newfds.empty() && _accept_callback) _accept_callback(_newfds);
+            _newfds.clear();
+        }
+        //io_uring后端下每个新连接一个完成事件，本轮循环中获取到的新连接在循环末尾统一处理
+        virtual void OnComplete(UringOp /*op*/, int res, uint32_t flags) {
+            if (res >= 0) {
+                if (_newfds.empty()) _loop->QueueCork(std::bind(&Acceptor::FlushAccepted, this));
+                _newfds.push_back(res);
+            }else if (res == -EMFILE || res == -ENFILE) {
+                ERR_LOG("SOCKET ACCEPT FAILED: TOO MANY OPEN FILES!");
+                ReleaseOverflow();
+            }else if (res != -ECANCELED) {
+                ERR_LOG("SOCKET ACCEPT FAILED!");
             }
-            if (_accept_callback) _accept_callback(newfd);
+            //内核结束了这次multishot（比如出错），重新提交
+            if (!(flags & IORING_CQE_F_MORE) && _uring_accepting) _loop->Uring()->AcceptMultishot(_socket.Fd(), this);
+        }
+        void ReleaseOverflow() {
+            if (_idle_fd < 0) return;
+            close(_idle_fd);
+            int fd = accept(_socket.Fd(), NULL, NULL);
+            if (fd >= 0) close(fd);
+            _idle_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
         }
         int CreateServer(int port) {
-            bool ret = _socket.CreateServer(port);
+            bool ret = _socket.CreateServer(port, "0.0.0.0", true);//监听套接字必须是非阻塞的，才能循环获取到EAGAIN
             assert(ret == true);
             return _socket.Fd();
         }
@@ -1053,22 +3168,63 @@ class Acceptor {
         /*不能将启动读事件监控，放到构造函数中，必须在设置回调函数后，再去启动*/
         /*否则有可能造成启动监控后，立即有事件，处理的时候，回调函数还没设置：新连接得不到处理，且资源泄漏*/
         Acceptor(EventLoop *loop, int port): _socket(CreateServer(port)), _loop(loop), 
-            _channel(loop, _socket.Fd()) {
+            _channel(loop, _socket.Fd()), _idle_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+            _accept_budget(ACCEPT_BUDGET_DEFAULT), _uring_accepting(false) {
             _channel.SetReadCallback(std::bind(&Acceptor::HandleRead, this));
         }
+        ~Acceptor() { if (_idle_fd >= 0) close(_idle_fd); }
         void SetAcceptCallback(const AcceptCallback &cb) { _accept_callback = cb; }
-        void Listen() { _channel.EnableRead(); }
+        //设置一次可读事件中最多获取的新连接数量
+        void SetAcceptBudget(int budget) { _accept_budget = budget > 0 ? budget : 1; }
+        //必须在loop线程中调用
+        void Listen() {
+            if (_loop->Uring() == NULL) return _channel.EnableRead();
+            _uring_accepting = true;
+            _loop->Uring()->AcceptMultishot(_socket.Fd(), this);
+        }
+        //停止获取新连接，把全连接队列中已有的连接取完之后关闭监听套接字
+        void Close() {
+            if (_uring_accepting) {
+                _uring_accepting = false;
+                _loop->Uring()->Cancel(this, URING_OP_ACCEPT);
+            }
+            _channel.Remove();
+            HandleRead();
+            _socket.Close();
+        }
 };
 
+#define REBALANCE_HOT_ROUNDS 3 //从属线程连续几次检查都处于繁忙状态才迁移连接
 class TcpServer {
     private:
-        uint64_t _next_id;      //这是一个自动增长的连接ID，
+        std::atomic<uint64_t> _next_id;//这是一个自动增长的连接ID，端口复用模式下会在多个线程中获取
         int _port;
         int _timeout;           //这是非活跃连接的统计时间---多长时间无通信就是非活跃连接
+        uint64_t _read_budget;  //每个连接一次可读事件中最多读取的字节数
+        bool _edge_trigger;     //连接是否使用边缘触发模式
+        bool _auto_cork;        //连接是否合并一轮循环中的多次发送
+        bool _reuse_port;       //每个从属线程是否使用自己的SO_REUSEPORT监听套接字
         bool _enable_inactive_release;//是否启动了非活跃连接超时销毁的判断标志
+        uint32_t _rebalance_ratio; //从属线程的繁忙比例（千分比）持续高于这个值时迁出部分连接，0表示不启用
+        int _rebalance_interval;   //检查从属线程繁忙比例的间隔（秒）
+        std::vector<int> _hot_rounds;//每个从属线程连续处于繁忙状态的检查次数
         EventLoop _baseloop;    //这是主线程的EventLoop对象，负责监听事件的处理
         Acceptor _acceptor;    //这是监听套接字的管理对象
         LoopThreadPool _pool;   //这是从属EventLoop线程池
+        std::unordered_map<EventLoop *, Acceptor *> _loop_acceptors;//端口复用模式下每个从属线程自己的监听套接字
+        /*运行时调整从属线程数量*/
+        struct RetiringLoop {
+            LoopThread *_thread;    //被移出线程池、等待回收的线程
+            EventLoop *_loop;
+            bool _migrate;          //true-把已有连接迁移到其他线程； false-等待已有连接自然关闭
+            int _idle_rounds;       //连续几次检查都没有连接了
+        };
+        std::vector<RetiringLoop> _retiring;//等待回收的从属线程
+        int _scale_min, _scale_max;     //自动伸缩时从属线程数量的范围，_scale_max为0表示不启用
+        uint32_t _scale_high, _scale_low;//从属线程平均繁忙比例（千分比）持续高于_scale_high时新增线程，持续低于_scale_low时回收线程
+        int _scale_interval;            //检查的间隔（秒）
+        int _scale_rounds;              //大于0表示连续偏高的检查次数，小于0表示连续偏低的检查次数
+        std::mutex _conns_mutex;//端口复用模式下连接在各个从属线程中创建，_conns需要加锁
         std::unordered_map<uint64_t, PtrConnection> _conns;//保存管理所有连接对应的shared_ptr对象
 
         using ConnectedCallback = std::function<void(const PtrConnection&)>;
@@ -1080,26 +3236,205 @@ class TcpServer {
         MessageCallback _message_callback;
         ClosedCallback _closed_callback;
         AnyEventCallback _event_callback;
+        Connection::PtrCallbacks _conn_callbacks; //所有连接共享的回调集合
     private:
         void RunAfterInLoop(const Functor &task, int delay) {
-            _next_id++;
-            _baseloop.TimerAdd(_next_id, delay, task);
+            _baseloop.RunAfter((uint64_t)delay * 1000, task);
+        }
+        //所有连接共享同一份回调，回调被修改之后再重新生成
+        const Connection::PtrCallbacks &ConnCallbacks() {
+            if (!_conn_callbacks) {
+                _conn_callbacks = std::make_shared<Connection::Callbacks>();
+                _conn_callbacks->_message_callback = _message_callback;
+                _conn_callbacks->_closed_callback = _closed_callback;
+                _conn_callbacks->_connected_callback = _connected_callback;
+                _conn_callbacks->_event_callback = _event_callback;
+                _conn_callbacks->_server_closed_callback = std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1);
+            }
+            return _conn_callbacks;
         }
         //为新连接构造一个Connection进行管理
-        void NewConnection(int fd) {
-            _next_id++;
-            PtrConnection conn(new Connection(_pool.NextLoop(), _next_id, fd));
-            conn->SetMessageCallback(_message_callback);
-            conn->SetClosedCallback(_closed_callback);
-            conn->SetConnectedCallback(_connected_callback);
-            conn->SetAnyEventCallback(_event_callback);
-            conn->SetSrvClosedCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
-            if (_enable_inactive_release) conn->EnableInactiveRelease(_timeout);//启动非活跃超时销毁
-            conn->Established();//就绪初始化
-            _conns.insert(std::make_pair(_next_id, conn));
+        PtrConnection CreateConnection(EventLoop *loop, int fd) {
+            uint64_t id = ++_next_id;
+            PtrConnection conn(new Connection(loop, id, fd));
+            conn->SetCallbacks(ConnCallbacks());
+            conn->SetReadBudget(_read_budget);
+            if (_edge_trigger) conn->EnableEdgeTrigger();
+            if (_auto_cork) conn->EnableAutoCork();
+            std::unique_lock<std::mutex> lock(_conns_mutex);
+            _conns.insert(std::make_pair(id, conn));
+            return conn;
+        }
+        //为新连接创建Connection对象，按照从属EventLoop分组，每个EventLoop只投递一次任务、唤醒一次
+        void NewConnections(const std::vector<int> &fds) {
+            std::vector<std::pair<EventLoop *, std::vector<PtrConnection>>> batches;
+            for (int fd : fds) {
+                EventLoop *loop = _pool.NextLoop(fd);
+                PtrConnection conn = CreateConnection(loop, fd);
+                size_t i = 0;
+                while (i < batches.size() && batches[i].first != loop) i++;
+                if (i == batches.size()) batches.push_back(std::make_pair(loop, std::vector<PtrConnection>()));
+                batches[i].second.push_back(conn);
+            }
+            for (auto &batch : batches) {
+                batch.first->RunInLoop(std::bind(&TcpServer::EstablishedInLoop, this, std::move(batch.second)));
+            }
+        }
+        //端口复用模式下，从属线程自己获取到的新连接直接在本线程中创建并就绪，没有跨线程的转交
+        void NewLocalConnections(EventLoop *loop, const std::vector<int> &fds) {
+            std::vector<PtrConnection> conns;
+            conns.reserve(fds.size());
+            for (int fd : fds) {
+                conns.push_back(CreateConnection(loop, fd));
+            }
+            EstablishedInLoop(conns);
+        }
+        void StartLoopAcceptor(EventLoop *loop) {
+            Acceptor *acceptor = new Acceptor(loop, _port);
+            acceptor->SetAcceptCallback(std::bind(&TcpServer::NewLocalConnections, this, loop, std::placeholders::_1));
+            _loop_acceptors[loop] = acceptor;
+            loop->RunInLoop(std::bind(&Acceptor::Listen, acceptor));
+        }
+        //每个从属线程创建自己的监听套接字，由内核按照四元组把新连接分散到各个监听套接字上
+        void StartLoopAcceptors() {
+            ConnCallbacks();//先生成共享回调，避免多个线程同时生成
+            for (int i = 0; i < _pool.ThreadCount(); i++) {
+                StartLoopAcceptor(_pool.GetLoop(i));
+            }
+            //主线程的监听套接字不再参与分配，否则落到它上面的连接还是要跨线程转交
+            _acceptor.Close();
+        }
+        //在主线程中定期执行：找出繁忙比例持续过高的从属线程，把它的一半连接迁移到最空闲的从属线程
+        //只有一个连接的线程不做迁移，热点连接迁移到哪里都一样，迁走的是与它挤在一起的其他连接
+        void RebalanceInLoop() {
+            int count = _pool.ThreadCount();
+            _hot_rounds.resize(count, 0);
+            int hottest = -1, coldest = -1;
+            uint32_t hot_ratio = 0, cold_ratio = UINT32_MAX;
+            for (int i = 0; i < count; i++) {
+                uint32_t ratio = _pool.GetLoop(i)->BusyRatio();
+                _hot_rounds[i] = ratio >= _rebalance_ratio ? _hot_rounds[i] + 1 : 0;
+                if (_hot_rounds[i] >= REBALANCE_HOT_ROUNDS && ratio > hot_ratio) { hottest = i; hot_ratio = ratio; }
+                if (ratio < cold_ratio) { coldest = i; cold_ratio = ratio; }
+            }
+            //空闲线程的繁忙比例要明显低于阈值，否则迁移过去也只是把繁忙转移过去
+            if (hottest >= 0 && cold_ratio < _rebalance_ratio / 2) {
+                EventLoop *from = _pool.GetLoop(hottest), *to = _pool.GetLoop(coldest);
+                std::vector<PtrConnection> conns;
+                {
+                    std::unique_lock<std::mutex> lock(_conns_mutex);
+                    for (auto &it : _conns) {
+                        if (it.second->GetLoop() == from) conns.push_back(it.second);
+                    }
+                }
+                for (size_t i = 1; i < conns.size(); i += 2) {
+                    conns[i]->MigrateTo(to);
+                }
+                _hot_rounds[hottest] = 0;
+                DBG_LOG("REBALANCE: MIGRATE %zu CONNECTIONS FROM LOOP %d TO LOOP %d", conns.size() / 2, hottest, coldest);
+            }
+            RunAfterInLoop(std::bind(&TcpServer::RebalanceInLoop, this), _rebalance_interval);
+        }
+        /*以下几个接口都在主线程中执行*/
+        void AddLoopInLoop() {
+            EventLoop *loop = _pool.AddThread();
+            _hot_rounds.clear();
+            if (_reuse_port) StartLoopAcceptor(loop);
+            DBG_LOG("ADD LOOP THREAD, %d THREADS NOW", _pool.ThreadCount());
+        }
+        //回收连接数量最少的从属线程：先移出线程池不再分配新连接，之后定期检查，连接全部迁走或者关闭之后再回收
+        bool RetireLoopInLoop(bool migrate) {
+            //端口复用模式下主线程的监听套接字已经关闭，至少要保留一个从属线程获取新连接
+            if (_pool.ThreadCount() == 0 || (!_loop_acceptors.empty() && _pool.ThreadCount() == 1)) return false;
+            EventLoop *loop = _pool.GetLoop(0);
+            for (int i = 1; i < _pool.ThreadCount(); i++) {
+                if (_pool.GetLoop(i)->ConnCount() < loop->ConnCount()) loop = _pool.GetLoop(i);
+            }
+            LoopThread *thread = _pool.RetireThread(loop);
+            _hot_rounds.clear();
+            auto it = _loop_acceptors.find(loop);
+            if (it != _loop_acceptors.end()) {
+                //关闭这个线程的监听套接字，内核不再把新连接分给它
+                loop->RunInLoop(std::bind(&Acceptor::Close, it->second));
+            }
+            _retiring.push_back(RetiringLoop{thread, loop, migrate, 0});
+            if (_retiring.size() == 1) RunAfterInLoop(std::bind(&TcpServer::CheckRetiringInLoop, this), 1);
+            DBG_LOG("RETIRE LOOP THREAD, %d THREADS NOW", _pool.ThreadCount());
+            return true;
+        }
+        void ResizeInLoop(int count, bool migrate) {
+            if (count < 0) count = 0;
+            while (_pool.ThreadCount() < count) AddLoopInLoop();
+            while (_pool.ThreadCount() > count && RetireLoopInLoop(migrate));
+        }
+        //每秒检查一次等待回收的线程，迁移模式下每次都把剩下的连接迁走（关闭监听套接字时还可能获取到新连接）
+        //连续两次检查都没有连接了才真正回收，给迁移之前就已经投递到这个线程的任务留出转交的时间；
+        //已经释放的连接对象还可能被服务器或者使用者持有，之后调用的接口都会访问所属的EventLoop，因此还要等到这些对象全部析构
+        void CheckRetiringInLoop() {
+            for (auto it = _retiring.begin(); it != _retiring.end();) {
+                if (it->_loop->ConnCount() > 0) {
+                    it->_idle_rounds = 0;
+                    if (it->_migrate) MigrateAllInLoop(it->_loop);
+                    ++it;
+                    continue;
+                }
+                if (++it->_idle_rounds < 2 || it->_loop->ConnRefs() > 0) { ++it; continue; }
+                it->_thread->Stop();
+                delete it->_thread;
+                auto acc = _loop_acceptors.find(it->_loop);
+                if (acc != _loop_acceptors.end()) {
+                    delete acc->second;
+                    _loop_acceptors.erase(acc);
+                }
+                it = _retiring.erase(it);
+            }
+            if (!_retiring.empty()) RunAfterInLoop(std::bind(&TcpServer::CheckRetiringInLoop, this), 1);
+        }
+        //把loop中的所有连接按照分配策略迁移到线程池中的其他线程
+        void MigrateAllInLoop(EventLoop *loop) {
+            std::vector<PtrConnection> conns;
+            {
+                std::unique_lock<std::mutex> lock(_conns_mutex);
+                for (auto &it : _conns) {
+                    if (it.second->GetLoop() == loop) conns.push_back(it.second);
+                }
+            }
+            for (auto &conn : conns) {
+                conn->MigrateTo(_pool.NextLoop(conn->Fd()));
+            }
+        }
+        //自动伸缩：从属线程的平均繁忙比例连续几次检查都偏高就新增一个线程，都偏低就回收一个线程
+        void AutoScaleInLoop() {
+            int count = _pool.ThreadCount();
+            uint32_t total = 0;
+            for (int i = 0; i < count; i++) total += _pool.GetLoop(i)->BusyRatio();
+            uint32_t avg = count > 0 ? total / count : _baseloop.BusyRatio();
+            if (avg >= _scale_high && count < _scale_max) {
+                _scale_rounds = _scale_rounds > 0 ? _scale_rounds + 1 : 1;
+            }else if (avg <= _scale_low && count > _scale_min) {
+                _scale_rounds = _scale_rounds < 0 ? _scale_rounds - 1 : -1;
+            }else {
+                _scale_rounds = 0;
+            }
+            if (_scale_rounds >= REBALANCE_HOT_ROUNDS) {
+                AddLoopInLoop();
+                _scale_rounds = 0;
+            }else if (_scale_rounds <= -REBALANCE_HOT_ROUNDS) {
+                RetireLoopInLoop(true);
+                _scale_rounds = 0;
+            }
+            RunAfterInLoop(std::bind(&TcpServer::AutoScaleInLoop, this), _scale_interval);
+        }
+        //在连接所属的EventLoop线程中执行，启动非活跃超时销毁以及就绪初始化都会立即完成
+        void EstablishedInLoop(const std::vector<PtrConnection> &conns) {
+            for (auto &conn : conns) {
+                if (_enable_inactive_release) conn->EnableInactiveRelease(_timeout);//启动非活跃超时销毁
+                conn->Established();//就绪初始化
+            }
         }
         void RemoveConnectionInLoop(const PtrConnection &conn) {
             int id = conn->Id();
+            std::unique_lock<std::mutex> lock(_conns_mutex);
             auto it = _conns.find(id);
             if (it != _conns.end()) {
                 _conns.erase(it);
@@ -1110,33 +3445,119 @@ class TcpServer {
             _baseloop.RunInLoop(std::bind(&TcpServer::RemoveConnectionInLoop, this, conn));
         }
     public:
-        TcpServer(int port):
+        //backend为BACKEND_URING时主线程和从属线程都使用io_uring，连接的收发以及获取新连接都以批量提交的请求完成
+        TcpServer(int port, LoopBackend backend = BACKEND_EPOLL):
             _port(port), 
             _next_id(0), 
+            _read_budget(READ_BUDGET_DEFAULT),
+            _edge_trigger(false),
+            _auto_cork(false),
+            _reuse_port(false),
             _enable_inactive_release(false), 
+            _rebalance_ratio(0),
+            _rebalance_interval(1),
+            _baseloop(backend),
             _acceptor(&_baseloop, port),
-            _pool(&_baseloop) {
-            _acceptor.SetAcceptCallback(std::bind(&TcpServer::NewConnection, this, std::placeholders::_1));
+            _pool(&_baseloop),
+            _scale_min(0), _scale_max(0), _scale_high(0), _scale_low(0), _scale_interval(1), _scale_rounds(0) {
+            _pool.SetBackend(backend);
+            _acceptor.SetAcceptCallback(std::bind(&TcpServer::NewConnections, this, std::placeholders::_1));
             _acceptor.Listen();//将监听套接字挂到baseloop上
         }
+        //设置从属线程数量，设置为0时根据sched_getaffinity以及cgroup的CPU配额自动决定
         void SetThreadCount(int count) { return _pool.SetThreadCount(count); }
-        void SetConnectedCallback(const ConnectedCallback&cb) { _connected_callback = cb; }
-        void SetMessageCallback(const MessageCallback&cb) { _message_callback = cb; }
-        void SetClosedCallback(const ClosedCallback&cb) { _closed_callback = cb; }
-        void SetAnyEventCallback(const AnyEventCallback&cb) { _event_callback = cb; }
+        //从属线程的名称前缀，线程名称为前缀加上线程下标，便于top/perf等工具区分
+        void SetThreadName(const std::string &name) { _pool.SetThreadName(name); }
+        //第i个从属线程绑定到cpus[i % cpus.size()]中的CPU上
+        void SetThreadCpus(const std::vector<std::vector<int>> &cpus) { _pool.SetThreadCpus(cpus); }
+        //每个从属线程绑定一个CPU，第i个线程绑定到cpus[i % cpus.size()]
+        void SetThreadCpus(const std::vector<int> &cpus) {
+            std::vector<std::vector<int>> sets;
+            for (int cpu : cpus) sets.push_back(std::vector<int>(1, cpu));
+            _pool.SetThreadCpus(sets);
+        }
+        //从属线程的内存从线程所在的NUMA节点分配，一般和SetThreadCpus一起使用
+        void EnableNumaLocal() { _pool.EnableNumaLocal(); }
+        //设置新连接分配到从属线程的策略，默认轮询；端口复用模式下由内核分配，策略不生效
+        void SetLoopStrategy(LoopStrategy strategy) { _pool.SetStrategy(strategy); }
+        //使用自定义的分配策略，TcpServer接管selector的释放
+        void SetLoopSelector(LoopSelector *selector) { _pool.SetSelector(selector); }
+        void SetConnectedCallback(const ConnectedCallback&cb) { _connected_callback = cb; _conn_callbacks.reset(); }
+        void SetMessageCallback(const MessageCallback&cb) { _message_callback = cb; _conn_callbacks.reset(); }
+        void SetClosedCallback(const ClosedCallback&cb) { _closed_callback = cb; _conn_callbacks.reset(); }
+        void SetAnyEventCallback(const AnyEventCallback&cb) { _event_callback = cb; _conn_callbacks.reset(); }
         void EnableInactiveRelease(int timeout) { _timeout = timeout; _enable_inactive_release = true; }
-        //用于添加一个定时任务
-        void RunAfter(const Functor &task, int delay) {
-            _baseloop.RunInLoop(std::bind(&TcpServer::RunAfterInLoop, this, task, delay));
+#if defined(__cpp_impl_coroutine)
+        //每个新连接启动一个处理协程，连接的数据都由协程通过ReadUntil/ReadExactly读取，不再使用消息回调
+        void SetCoroutineHandler(const std::function<CoTask<>(PtrConnection)> &handler) {
+            SetConnectedCallback([handler](const PtrConnection &conn) { handler(conn).Detach(); });
+            SetMessageCallback([](const PtrConnection &, Buffer *) {});//协程没有在等待时数据留在缓冲区中
+        }
+#endif
+        void SetReadBudget(uint64_t budget) { _read_budget = budget; }
+        //设置监听套接字一次可读事件中最多获取的新连接数量
+        void SetAcceptBudget(int budget) { _acceptor.SetAcceptBudget(budget); }
+        //新连接使用边缘触发模式，减少开关可写事件监控的epoll_ctl调用
+        void EnableEdgeTrigger() { _edge_trigger = true; }
+        //新连接合并一轮循环中的多次发送，适合请求流水线/批量处理的协议
+        void EnableAutoCork() { _auto_cork = true; }
+        //每个从属线程使用自己的SO_REUSEPORT监听套接字并在本线程中获取新连接，必须在Start之前设置
+        void EnableReusePort() { _reuse_port = true; }
+        //从属线程启动忙轮询模式，处理完事件之后spin_us微秒内不睡眠，sock_us大于0时连接套接字还会设置SO_BUSY_POLL
+        //会一直占用CPU，一般和SetThreadCpus一起使用，让每个从属线程独占一个CPU；必须在Start之前设置
+        void EnableBusyPoll(uint64_t spin_us, int sock_us = 0) { _pool.EnableBusyPoll(spin_us, sock_us); }
+        //设置主线程以及所有从属线程每轮执行普通/批量任务的预算（最多count个、最长us微秒），剩下的推迟到下一轮，避免大量任务长时间阻塞IO处理
+        //在Start之前或者主线程中调用
+        void SetTaskBudget(uint64_t count, uint64_t us) {
+            _baseloop.SetTaskBudget(count, us);
+            _pool.SetTaskBudget(count, us);
+        }
+        //启动连接迁移：从属线程的繁忙比例连续几次检查都超过ratio（千分比）时，把它的一半连接迁移到最空闲的从属线程
+        void EnableRebalance(uint32_t ratio, int interval = 1) {
+            _rebalance_ratio = ratio;
+            _rebalance_interval = interval > 0 ? interval : 1;
+        }
+        //运行时调整从属线程数量，可以在任意线程中调用；减少线程时，migrate为true则把被回收线程中的连接迁移到其他线程，
+        //为false则等待这些连接自然关闭之后再回收线程，这期间被回收的线程不再分配新连接
+        void ResizeThreads(int count, bool migrate = true) {
+            _baseloop.RunInLoop(std::bind(&TcpServer::ResizeInLoop, this, count, migrate));
+        }
+        //根据从属线程的平均繁忙比例（千分比）在[min, max]之间自动调整线程数量，必须在Start之前设置
+        void EnableAutoScale(int min, int max, uint32_t high, uint32_t low, int interval = 1) {
+            _scale_min = min > 0 ? min : 0;
+            _scale_max = max > _scale_min ? max : _scale_min;
+            _scale_high = high;
+            _scale_low = low;
+            _scale_interval = interval > 0 ? interval : 1;
+        }
+        //用于添加一个定时任务，delay的单位是秒，返回的ID用于CancelTimer取消
+        uint64_t RunAfter(const Functor &task, int delay) {
+            return _baseloop.RunAfter((uint64_t)delay * 1000, task);
+        }
+        void CancelTimer(uint64_t id) { _baseloop.TimerCancel(id); }
+        void Start() {
+            _pool.Create();
+            if (_reuse_port && _pool.ThreadCount() > 0) StartLoopAcceptors();
+            if (_rebalance_ratio > 0) RunAfter(std::bind(&TcpServer::RebalanceInLoop, this), _rebalance_interval);
+            if (_scale_max > 0) RunAfter(std::bind(&TcpServer::AutoScaleInLoop, this), _scale_interval);
+            _baseloop.Start();
         }
-        void Start() { _pool.Create();  _baseloop.Start(); }
 };
 
 
 void Channel::Remove() { return _loop->RemoveEvent(this); }
 void Channel::Update() { return _loop->UpdateEvent(this); }
-void TimerWheel::TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb) {
-    _loop->RunInLoop(std::bind(&TimerWheel::TimerAddInLoop, this, id, delay, cb));
+void TimerWheel::TimerAdd(uint64_t id, uint64_t delay, TaskFunc cb) {
+    if (_loop->IsInLoop()) return TimerAddInLoop(id, delay, cb);
+    _loop->RunInLoop(std::bind(&TimerWheel::TimerAddInLoop, this, id, delay, std::move(cb)));
+}
+void TimerWheel::TimerAt(uint64_t id, uint64_t when, TaskFunc cb) {
+    if (_loop->IsInLoop()) return TimerAtInLoop(id, when, 0, cb);
+    _loop->RunInLoop(std::bind(&TimerWheel::TimerAtInLoop, this, id, when, (uint64_t)0, std::move(cb)));
+}
+void TimerWheel::TimerEvery(uint64_t id, uint64_t interval, TaskFunc cb) {
+    if (_loop->IsInLoop()) return TimerEveryInLoop(id, interval, cb);
+    _loop->RunInLoop(std::bind(&TimerWheel::TimerEveryInLoop, this, id, interval, std::move(cb)));
 }
 //刷新/延迟定时任务
 void TimerWheel::TimerRefresh(uint64_t id) {
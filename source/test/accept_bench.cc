@@ -0,0 +1,67 @@
+/*新连接接收速率测试：对比主线程单个监听套接字转交新连接，与每个从属线程使用自己的SO_REUSEPORT监听套接字*/
+/*
+    服务器在连接建立后发送一个字节并关闭连接，客户端收到这个字节就算一次完整的建立连接，统计每秒完成的连接数
+*/
+#include "../server.hpp"
+#include <sys/wait.h>
+
+#define BENCH_PORT 8086
+#define BENCH_THREADS 4
+#define BENCH_CLIENTS 8
+#define BENCH_SECONDS 5
+
+void OnConnected(const PtrConnection &conn) {
+    conn->Send("A", 1);
+    conn->Shutdown();
+}
+void RunServer(bool reuse_port) {
+    freopen("/dev/null", "w", stdout);//每个连接的调试日志会严重影响测试结果
+    TcpServer server(BENCH_PORT);
+    server.SetThreadCount(BENCH_THREADS);
+    server.SetConnectedCallback(OnConnected);
+    server.SetAcceptBudget(64);
+    if (reuse_port) server.EnableReusePort();
+    server.Start();
+}
+uint64_t RunClients() {
+    std::atomic<uint64_t> total(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        threads.emplace_back([&]() {
+            uint64_t count = 0;
+            while (!stop) {
+                Socket cli_sock;
+                if (cli_sock.CreateClient(BENCH_PORT, "127.0.0.1") == false) continue;
+                char c;
+                if (recv(cli_sock.Fd(), &c, 1, 0) == 1) count++;
+            }
+            total += count;
+        });
+    }
+    sleep(BENCH_SECONDS);
+    stop = true;
+    for (auto &t : threads) t.join();
+    return total;
+}
+double Bench(bool reuse_port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        RunServer(reuse_port);
+        exit(0);
+    }
+    sleep(1);//等待服务器启动
+    uint64_t total = RunClients();
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return (double)total / BENCH_SECONDS;
+}
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    double single = Bench(false);
+    double reuse = Bench(true);
+    printf("single acceptor: %.0f conn/s\n", single);
+    printf("reuseport      : %.0f conn/s (%.2fx)\n", reuse, single > 0 ? reuse / single : 0);
+    return 0;
+}
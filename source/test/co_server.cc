@@ -0,0 +1,118 @@
+/*协程接口示例：用顺序的代码实现一个简单的请求-响应协议，需要C++20编译*/
+/*
+    请求：若干行头部，以空行结束，其中"Length: n"表示后面跟着n字节的正文，"Sleep: ms"表示处理前先等待ms毫秒
+    响应：原样返回正文；"Close: 1"表示响应之后关闭连接，"Throw: 1"表示处理协程抛出异常
+    客户端分别在epoll以及io_uring后端上检查流水线请求、分段到达的请求、Sleep、关闭连接以及协程异常
+*/
+#include "../server.hpp"
+#include <sys/wait.h>
+
+#define CO_PORT 8088
+
+std::string Header(const std::string &head, const std::string &key) {
+    size_t pos = head.find(key + ": ");
+    if (pos == std::string::npos) return "";
+    size_t end = head.find("\r\n", pos);
+    return head.substr(pos + key.size() + 2, end - pos - key.size() - 2);
+}
+CoTask<std::string> ReadRequest(PtrConnection conn, std::string *head) {
+    *head = co_await conn->ReadUntil("\r\n\r\n");
+    if (head->empty()) co_return "";
+    uint64_t len = atoi(Header(*head, "Length").c_str());
+    if (len == 0) co_return "";
+    co_return co_await conn->ReadExactly(len);
+}
+CoTask<> Handle(PtrConnection conn) {
+    while (true) {
+        std::string head;
+        std::string body = co_await ReadRequest(conn, &head);
+        if (head.empty()) break;//连接已经关闭
+        std::string sleep = Header(head, "Sleep");
+        if (!sleep.empty()) co_await conn->Sleep(atoi(sleep.c_str()));
+        if (Header(head, "Throw") == "1") throw std::runtime_error("handler failed");
+        if (!co_await conn->Write(body)) break;
+        if (Header(head, "Close") == "1") {
+            conn->Shutdown();
+            break;
+        }
+    }
+}
+void RunServer(LoopBackend backend) {
+    freopen("/dev/null", "w", stdout);
+    TcpServer server(CO_PORT, backend);
+    server.SetThreadCount(2);
+    server.EnableInactiveRelease(10);
+    server.SetCoroutineHandler(Handle);
+    server.Start();
+}
+std::string Request(const std::string &body, const std::string &extra = "") {
+    return "Length: " + std::to_string(body.size()) + "\r\n" + extra + "\r\n" + body;
+}
+bool Expect(int fd, const std::string &want) {
+    std::string got;
+    char buf[4096];
+    while (got.size() < want.size()) {
+        ssize_t ret = recv(fd, buf, std::min(sizeof(buf), want.size() - got.size()), 0);
+        if (ret <= 0) break;
+        got.append(buf, ret);
+    }
+    return got == want;
+}
+bool RunClient() {
+    bool ok = true;
+    Socket cli;
+    if (!cli.CreateClient(CO_PORT, "127.0.0.1")) return false;
+    //流水线：一次发送多个请求
+    std::string big(100000, 'b');
+    std::string reqs = Request("hello") + Request(big) + Request("world");
+    send(cli.Fd(), reqs.data(), reqs.size(), 0);
+    ok &= Expect(cli.Fd(), "hello" + big + "world");
+    //分段到达：分隔符和正文都被拆开
+    std::string req = Request("split");
+    for (size_t i = 0; i < req.size(); i++) {
+        send(cli.Fd(), req.data() + i, 1, 0);
+        usleep(1000);
+    }
+    ok &= Expect(cli.Fd(), "split");
+    //Sleep之后再响应
+    uint64_t start = EventLoop::MonotonicUs();
+    req = Request("slept", "Sleep: 500\r\n");
+    send(cli.Fd(), req.data(), req.size(), 0);
+    ok &= Expect(cli.Fd(), "slept");
+    ok &= EventLoop::MonotonicUs() - start >= 500 * 1000;
+    //响应之后服务器关闭连接
+    req = Request("bye", "Close: 1\r\n");
+    send(cli.Fd(), req.data(), req.size(), 0);
+    ok &= Expect(cli.Fd(), "bye");
+    char c;
+    ok &= recv(cli.Fd(), &c, 1, 0) == 0;
+    //处理协程抛出异常：协程结束并释放，服务器继续处理其他连接
+    Socket bad, good;
+    if (!bad.CreateClient(CO_PORT, "127.0.0.1") || !good.CreateClient(CO_PORT, "127.0.0.1")) return false;
+    req = Request("boom", "Throw: 1\r\n");
+    send(bad.Fd(), req.data(), req.size(), 0);
+    usleep(100000);
+    req = Request("alive");
+    send(good.Fd(), req.data(), req.size(), 0);
+    ok &= Expect(good.Fd(), "alive");
+    return ok;
+}
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    LoopBackend backends[] = { BACKEND_EPOLL, BACKEND_URING };
+    for (LoopBackend backend : backends) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            RunServer(backend);
+            exit(0);
+        }
+        sleep(1);//等待服务器启动
+        bool ok = RunClient();
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        printf("%s: %s\n", backend == BACKEND_URING ? "io_uring" : "epoll", ok ? "OK" : "FAILED");
+    }
+    return 0;
+}
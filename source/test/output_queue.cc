@@ -0,0 +1,35 @@
+/*发送队列的长时间流式发送测试：队列始终不为空，已发送的分段必须被回收，占用的空间不能随发送量增长*/
+#include <atomic>
+#include <cstdlib>
+#include <new>
+static size_t g_max_alloc = 0;//测试阶段单次申请的最大字节数
+void *operator new(size_t n) { if (n > g_max_alloc) g_max_alloc = n; return malloc(n); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#include "../server.hpp"
+
+#define STREAM_ROUNDS 100000
+
+int main()
+{
+    bool ok = true;
+    BlockPool pool;
+    BlockPool *pools[] = { NULL, &pool };
+    for (BlockPool *p : pools) {
+        OutputQueue queue(p);
+        std::string block(OUTPUT_BLOCK_SIZE, 'x');
+        queue.Write("head", 4);//先留下一小段数据，之后每轮写入一整块、发送一整块，队列永远不会清空
+        g_max_alloc = 0;
+        for (int i = 0; i < STREAM_ROUNDS; i++) {
+            queue.Write(block.data(), block.size());
+            queue.MoveReadOffset(block.size());
+        }
+        struct iovec iov[8];
+        int cnt = queue.PeekIov(iov, 8);
+        bool round_ok = queue.ReadAbleSize() == 4 && cnt == 1 && iov[0].iov_len == 4 && g_max_alloc <= OUTPUT_BLOCK_SIZE;
+        printf("%s: pending %lu, segments %d, max alloc %zu: %s\n", p ? "pool" : "no pool",
+            queue.ReadAbleSize(), cnt, g_max_alloc, round_ok ? "OK" : "FAILED");
+        ok &= round_ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+/*io_uring后端与epoll后端的对比测试：回显服务器以及HTTP服务器*/
+/*
+    每个客户端线程使用一个长连接，发送一个请求、收到完整的响应之后再发送下一个，统计每秒完成的请求数
+    同时检查响应内容，两种后端的行为必须完全一致
+    io_uring后端总是把一轮循环中的发送合并成一个请求，因此同时给出epoll开启合并发送的结果作为对照
+*/
+#include "../http.hpp"
+#include <sys/wait.h>
+
+#define BENCH_PORT 8087
+#define BENCH_THREADS 4
+#define BENCH_CLIENTS 32
+#define BENCH_SECONDS 5
+#define ECHO_SIZE 64
+
+void OnMessage(const PtrConnection &conn, Buffer *buf) {
+    conn->Send(buf->ReadPosition(), buf->ReadAbleSize());
+    buf->MoveReadOffset(buf->ReadAbleSize());
+}
+void Hello(const HttpRequest &req, HttpResponse *rsp) {
+    rsp->SetContent("hello world", "text/plain");
+}
+void RunServer(bool http, LoopBackend backend, bool cork) {
+    freopen("/dev/null", "w", stdout);//每个连接的调试日志会严重影响测试结果
+    if (http) {
+        HttpServer server(BENCH_PORT, DEFALT_TIMEOUT, backend);
+        server.SetThreadCount(BENCH_THREADS);
+        server.Get("/hello", Hello);
+        if (cork) server.EnableAutoCork();
+        server.Listen();
+        return;
+    }
+    TcpServer server(BENCH_PORT, backend);
+    server.SetThreadCount(BENCH_THREADS);
+    server.SetMessageCallback(OnMessage);
+    if (cork) server.EnableAutoCork();
+    server.Start();
+}
+//一次回显：发送ECHO_SIZE字节，收到同样的数据
+bool EchoOnce(int fd) {
+    char req[ECHO_SIZE], rsp[ECHO_SIZE];
+    memset(req, 'a' + fd % 26, sizeof(req));
+    if (send(fd, req, sizeof(req), 0) != sizeof(req)) return false;
+    size_t got = 0;
+    while (got < sizeof(rsp)) {
+        ssize_t ret = recv(fd, rsp + got, sizeof(rsp) - got, 0);
+        if (ret <= 0) return false;
+        got += ret;
+    }
+    return memcmp(req, rsp, sizeof(req)) == 0;
+}
+//一次HTTP请求：读到头部结束，再按照Content-Length读取正文
+bool HttpOnce(int fd) {
+    static const char req[] = "GET /hello HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+    if (send(fd, req, sizeof(req) - 1, 0) != sizeof(req) - 1) return false;
+    std::string rsp;
+    char buf[4096];
+    size_t pos;
+    while ((pos = rsp.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t ret = recv(fd, buf, sizeof(buf), 0);
+        if (ret <= 0) return false;
+        rsp.append(buf, ret);
+    }
+    size_t len_pos = rsp.find("Content-Length: ");
+    if (len_pos == std::string::npos) return false;
+    size_t total = pos + 4 + atoi(rsp.c_str() + len_pos + 16);
+    while (rsp.size() < total) {
+        ssize_t ret = recv(fd, buf, sizeof(buf), 0);
+        if (ret <= 0) return false;
+        rsp.append(buf, ret);
+    }
+    return rsp.compare(pos + 4, std::string::npos, "hello world") == 0;
+}
+uint64_t RunClients(bool http, bool *ok) {
+    std::atomic<uint64_t> total(0);
+    std::atomic<bool> stop(false), failed(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        threads.emplace_back([&]() {
+            Socket cli_sock;
+            if (cli_sock.CreateClient(BENCH_PORT, "127.0.0.1") == false) { failed = true; return; }
+            uint64_t count = 0;
+            while (!stop) {
+                if (!(http ? HttpOnce(cli_sock.Fd()) : EchoOnce(cli_sock.Fd()))) { failed = true; break; }
+                count++;
+            }
+            total += count;
+        });
+    }
+    sleep(BENCH_SECONDS);
+    stop = true;
+    for (auto &t : threads) t.join();
+    *ok = !failed;
+    return total;
+}
+double Bench(bool http, LoopBackend backend, bool cork) {
+    fflush(stdout);//避免子进程退出时把继承的缓冲区再输出一遍
+    pid_t pid = fork();
+    if (pid == 0) {
+        RunServer(http, backend, cork);
+        exit(0);
+    }
+    sleep(1);//等待服务器启动
+    bool ok = false;
+    uint64_t total = RunClients(http, &ok);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (!ok) printf("%s %s: RESPONSE CHECK FAILED\n", http ? "http" : "echo", backend == BACKEND_URING ? "io_uring" : "epoll");
+    return (double)total / BENCH_SECONDS;
+}
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    for (int http = 0; http < 2; http++) {
+        const char *name = http ? "http" : "echo";
+        double epoll = Bench(http, BACKEND_EPOLL, false);
+        double cork = Bench(http, BACKEND_EPOLL, true);
+        double uring = Bench(http, BACKEND_URING, false);
+        printf("%s epoll     : %.0f req/s\n", name, epoll);
+        printf("%s epoll+cork: %.0f req/s\n", name, cork);
+        printf("%s io_uring  : %.0f req/s (%.2fx epoll+cork)\n", name, uring, cork > 0 ? uring / cork : 0);
+    }
+    return 0;
+}